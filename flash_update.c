@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ *    FLIR Video Device driver.
+ *    Differential update of the FPGA image in SPI NOR flash
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "flir_kernel_os.h"
+#include "fpga.h"
+#include "fvdk_internal.h"
+#include "fvdk_ioctl.h"
+#include <linux/platform_device.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/mtd/mtd.h>
+#include "roco_header.h"
+
+struct flash_update_state {
+	struct mtd_info *mtd;
+	unsigned char *old;	// Current sector contents
+	unsigned char *new;	// Sector contents after update
+	ktime_t write_time;	// Time spent erasing and programming
+	struct fvdk_flash_update *req;
+};
+
+#if KERNEL_VERSION(4, 17, 0) > LINUX_VERSION_CODE
+static void erase_done(struct erase_info *ei)
+{
+	complete((struct completion *)ei->priv);
+}
+#endif
+
+static int erase_sector(struct mtd_info *mtd, loff_t ofs)
+{
+	struct erase_info ei = {
+		.addr = ofs,
+		.len = mtd->erasesize,
+	};
+	int ret;
+
+#if KERNEL_VERSION(4, 17, 0) > LINUX_VERSION_CODE
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	ei.mtd = mtd;
+	ei.callback = erase_done;
+	ei.priv = (u_long)&done;
+	ret = mtd_erase(mtd, &ei);
+	if (ret == 0) {
+		wait_for_completion(&done);
+		if (ei.state == MTD_ERASE_FAILED)
+			ret = -EIO;
+	}
+#else
+	ret = mtd_erase(mtd, &ei);
+#endif
+	return ret;
+}
+
+/**
+ * Write len bytes from user buffer src to flash at start. Sectors are
+ * read back and compared first, unchanged sectors are skipped. On NOR
+ * flash, sectors that only clear bits are programmed without erase,
+ * other flash types are always erased before programming.
+ *
+ * @return 0 on success, <0 on error
+ */
+static int update_range(struct flash_update_state *st, loff_t start,
+			const u8 __user *src, size_t len)
+{
+	struct mtd_info *mtd = st->mtd;
+	struct fvdk_flash_update *req = st->req;
+	u32 erasesize = mtd->erasesize;
+	loff_t end = start + len;
+	loff_t ofs;
+	int ret;
+
+	for (ofs = start - mtd_mod_by_eb(start, mtd); ofs < end; ofs += erasesize) {
+		loff_t from = max(ofs, start);
+		loff_t to = min_t(loff_t, ofs + erasesize, end);
+		BOOL need_erase = mtd->type != MTD_NORFLASH;
+		size_t retlen;
+		ktime_t t;
+		u32 i;
+
+		ret = read_mtd(mtd, ofs, erasesize, st->old);
+		if (ret)
+			return ret;
+
+		memcpy(st->new, st->old, erasesize);
+		if (copy_from_user(st->new + (from - ofs), src + (from - start),
+				   to - from))
+			return -EFAULT;
+
+		req->sectors++;
+		if (!memcmp(st->old, st->new, erasesize)) {
+			req->bytes_skipped += erasesize;
+			continue;
+		}
+
+		// NOR programming can only clear bits
+		for (i = 0; !need_erase && i < erasesize; i++) {
+			if (st->new[i] & ~st->old[i])
+				need_erase = TRUE;
+		}
+
+		t = ktime_get();
+		if (need_erase) {
+			ret = erase_sector(mtd, ofs);
+			if (ret) {
+				pr_err("Failed erasing flash at 0x%llx (%d)\n",
+				       (unsigned long long)ofs, ret);
+				return ret;
+			}
+		}
+
+		ret = mtd_write(mtd, ofs, erasesize, &retlen, st->new);
+		if (ret == 0 && retlen != erasesize)
+			ret = -EIO;
+		if (ret) {
+			pr_err("Failed writing flash at 0x%llx (%d)\n",
+			       (unsigned long long)ofs, ret);
+			return ret;
+		}
+		st->write_time = ktime_add(st->write_time, ktime_sub(ktime_get(), t));
+		req->sectors_written++;
+	}
+
+	return 0;
+}
+
+/**
+ * Update the FPGA image and header in the SPI flash, rewriting only the
+ * sectors that differ from the current flash contents.
+ *
+ * @param req image and header buffers, returns update statistics
+ *
+ * @return 0 on success, <0 on error
+ */
+int update_spi_flash(struct device *dev, struct fvdk_flash_update *req)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct flash_update_state st = { .req = req };
+	ktime_t start = ktime_get();
+	loff_t header_offset;
+	int ret;
+
+	req->sectors = 0;
+	req->sectors_written = 0;
+	req->bytes_skipped = 0;
+	req->elapsed_ms = 0;
+	req->saved_ms = 0;
+
+	st.mtd = get_fpga_mtd();
+	if (IS_ERR(st.mtd)) {
+		dev_err(dev, "Failed to get mtd device\n");
+		return PTR_ERR(st.mtd);
+	}
+
+	header_offset = st.mtd->size - HEADER_LENGTH;
+	if (req->image_size > header_offset || req->header_size > HEADER_LENGTH) {
+		ret = -EINVAL;
+		goto out_put;
+	}
+
+	st.old = vmalloc(st.mtd->erasesize);
+	st.new = vmalloc(st.mtd->erasesize);
+	if (!st.old || !st.new) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	mutex_lock(&data->muLoad);
+
+	ret = update_range(&st, 0, (const u8 __user *)(uintptr_t)req->image,
+			   req->image_size);
+	if (ret == 0 && req->header_size)
+		ret = update_range(&st, header_offset,
+				   (const u8 __user *)(uintptr_t)req->header,
+				   req->header_size);
+
+	// Header cache is stale once anything has been rewritten
+	if (req->sectors_written)
+		data->pDev.fpgaHeaderValid = FALSE;
+
+	mutex_unlock(&data->muLoad);
+
+	req->elapsed_ms = ktime_to_ms(ktime_sub(ktime_get(), start));
+	// Estimate from the average erase/program time of rewritten sectors
+	if (req->sectors_written)
+		req->saved_ms = div_u64(ktime_to_ms(st.write_time) *
+					(req->sectors - req->sectors_written),
+					req->sectors_written);
+
+	dev_info(dev, "Flash update: %u of %u sectors written, %llu bytes skipped, %u ms (saved ~%u ms)\n",
+		 req->sectors_written, req->sectors, req->bytes_skipped,
+		 req->elapsed_ms, req->saved_ms);
+
+out_free:
+	vfree(st.new);
+	vfree(st.old);
+out_put:
+	put_mtd_device(st.mtd);
+	return ret;
+}
@@ -0,0 +1,230 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ *    FLIR Video Device driver.
+ *    FPGA header store
+ *
+ *    The header is kept in a vmalloc'ed area that is also mapped read
+ *    only to user space (FVDK_MMAP_HEADER_OFFSET and the fpga_header
+ *    sysfs file). Updates are bracketed by the generation counter in
+ *    struct fvdk_header_map, odd while the header is being rewritten.
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "flir_kernel_os.h"
+#include "fpga.h"
+#include "fvdk_internal.h"
+#include "fvdk_ioctl.h"
+#include <linux/platform_device.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+
+int initFPGAHeader(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fpga_header *hdr = &data->pDev.fpga;
+
+	BUILD_BUG_ON(FVDK_HEADER_DATA_OFFSET + FPGA_HEADER_MAX_SIZE >
+		     FVDK_HEADER_MAP_SIZE);
+
+	// Zeroed and flagged for remap_vmalloc_range()
+	hdr->map = vmalloc_user(FVDK_HEADER_MAP_SIZE);
+	if (!hdr->map)
+		return -ENOMEM;
+
+	hdr->map->data_offset = FVDK_HEADER_DATA_OFFSET;
+	hdr->raw = (char *)hdr->map + FVDK_HEADER_DATA_OFFSET;
+	return 0;
+}
+
+void freeFPGAHeader(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fpga_header *hdr = &data->pDev.fpga;
+
+	mutex_lock(&data->muHeader);
+	vfree(hdr->map);
+	memset(hdr, 0, sizeof(*hdr));
+	data->pDev.fpgaHeaderValid = FALSE;
+	mutex_unlock(&data->muHeader);
+}
+
+/**
+ * Validate and store a new FPGA header, generic header followed by
+ * spec_size bytes of specific header and SDRAM buffer table.
+ *
+ * @param raw header data, copied
+ * @param len length of raw
+ *
+ * @return 0 on success, <0 on error
+ */
+int setFPGAHeader(struct device *dev, const void *raw, size_t len)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fpga_header *hdr = &data->pDev.fpga;
+	struct fvdk_header_map *map = hdr->map;
+	const GENERIC_FPGA_T *pGen = raw;
+	ULONG noOfBuffers = 0;
+	size_t tableSize;
+
+	if (len < sizeof(GENERIC_FPGA_T) || len > FPGA_HEADER_MAX_SIZE ||
+	    pGen->headerrev > GENERIC_REV || FPGA_HDR_SIZE(pGen) != len) {
+		dev_err(dev, "Invalid FPGA header (%zu bytes)\n", len);
+		return -EINVAL;
+	}
+
+	if (pGen->spec_size >= sizeof(BXAB_FPGA_T)) {
+		const BXAB_FPGA_T *pSpec = raw + sizeof(GENERIC_FPGA_T);
+
+		tableSize = pGen->spec_size - sizeof(BXAB_FPGA_T);
+		noOfBuffers = pSpec->noOfBuffers;
+		if (noOfBuffers > tableSize / sizeof(SDRAM_BUF_T)) {
+			dev_warn(dev, "FPGA header has %lu buffers, room for %zu\n",
+				 noOfBuffers, tableSize / sizeof(SDRAM_BUF_T));
+			noOfBuffers = tableSize / sizeof(SDRAM_BUF_T);
+		}
+	}
+
+	mutex_lock(&data->muHeader);
+	if (!map) {
+		mutex_unlock(&data->muHeader);
+		return -ENODEV;
+	}
+
+	WRITE_ONCE(map->generation, map->generation + 1);
+	smp_wmb();
+
+	memcpy(hdr->raw, raw, len);
+	// Clear what is left of a larger previous header
+	if (hdr->size > len)
+		memset(hdr->raw + len, 0, hdr->size - len);
+	hdr->size = len;
+	hdr->pGen = (GENERIC_FPGA_T *) hdr->raw;
+	hdr->pSpec = pGen->spec_size >= sizeof(BXAB_FPGA_T) ?
+		(BXAB_FPGA_T *) &hdr->raw[sizeof(GENERIC_FPGA_T)] : NULL;
+	hdr->pBuf = hdr->pSpec ? (SDRAM_BUF_T *) &hdr->pSpec[1] : NULL;
+	hdr->noOfBuffers = noOfBuffers;
+
+	map->size = len;
+	map->buffers = noOfBuffers;
+	map->buf_offset = hdr->pBuf ? (char *)hdr->pBuf - (char *)map : 0;
+
+	smp_wmb();
+	WRITE_ONCE(map->generation, map->generation + 1);
+
+	data->pDev.fpgaHeaderValid = TRUE;
+	mutex_unlock(&data->muHeader);
+
+	return 0;
+}
+
+/**
+ * Copy part of the stored header, zero filled beyond its end
+ */
+void copyFPGAHeader(struct device *dev, size_t offset, void *dst, size_t len)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fpga_header *hdr = &data->pDev.fpga;
+	size_t n = 0;
+
+	mutex_lock(&data->muHeader);
+	if (offset < hdr->size) {
+		n = min(len, hdr->size - offset);
+		memcpy(dst, &hdr->raw[offset], n);
+	}
+	mutex_unlock(&data->muHeader);
+
+	memset(dst + n, 0, len - n);
+}
+
+/**
+ * Copy the SDRAM buffer table to user space
+ *
+ * @return 0 on success, <0 on error
+ */
+int copyFPGABufTable(struct device *dev, void __user *dst)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fpga_header *hdr = &data->pDev.fpga;
+	int ret = 0;
+
+	mutex_lock(&data->muHeader);
+	if (hdr->noOfBuffers &&
+	    copy_to_user(dst, hdr->pBuf, hdr->noOfBuffers * sizeof(SDRAM_BUF_T)))
+		ret = -EFAULT;
+	mutex_unlock(&data->muHeader);
+
+	return ret;
+}
+
+/**
+ * Get one SDRAM buffer descriptor
+ *
+ * @return 0 on success, -EINVAL if index is out of range
+ */
+int getFPGABuf(struct device *dev, ULONG index, SDRAM_BUF_T *buf)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fpga_header *hdr = &data->pDev.fpga;
+	int ret = 0;
+
+	mutex_lock(&data->muHeader);
+	if (index < hdr->noOfBuffers)
+		*buf = hdr->pBuf[index];
+	else
+		ret = -EINVAL;
+	mutex_unlock(&data->muHeader);
+
+	return ret;
+}
+
+/**
+ * Map the header area read only
+ *
+ * @param pgoff page offset into the header area
+ *
+ * @return 0 on success, <0 on error
+ */
+int mapFPGAHeader(struct device *dev, struct vm_area_struct *vma,
+		  unsigned long pgoff)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+#if KERNEL_VERSION(6, 3, 0) <= LINUX_VERSION_CODE
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return remap_vmalloc_range(vma, data->pDev.fpga.map, pgoff);
+}
+
+/**
+ * Read part of the header area, for the sysfs file
+ *
+ * @return bytes read
+ */
+ssize_t readFPGAHeaderMap(struct device *dev, char *buf, loff_t off,
+			  size_t count)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fpga_header *hdr = &data->pDev.fpga;
+
+	if (off >= FVDK_HEADER_MAP_SIZE)
+		return 0;
+	count = min_t(size_t, count, FVDK_HEADER_MAP_SIZE - off);
+
+	// muHeader keeps the copy consistent, no generation check needed
+	mutex_lock(&data->muHeader);
+	memcpy(buf, (char *)hdr->map + off, count);
+	mutex_unlock(&data->muHeader);
+
+	return count;
+}
@@ -0,0 +1,557 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ *    FLIR Video Device driver.
+ *    Shared memory blob
+ *
+ *    The blob is an array of single pages, allocated and zeroed on the
+ *    first fault, so large blobs need neither a contiguous block nor
+ *    up front clearing of pages that are never touched.
+ *
+ *    Each blob mapping and dma-buf export is tracked, so the blob can be
+ *    resized without disturbing them: growing adds pages that appear on
+ *    fault, and shrinking is refused while one reaches into the tail.
+ *
+ *    A blob in reserved memory (fvdk_persist.c) takes its pages from the
+ *    region in order, and is not larger than the region.
+ *
+ *    User mappings are write protected, writes fault once per page and
+ *    mark it dirty for checkpoints (fvdk_checkpoint.c).
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "flir_kernel_os.h"
+#include "fpga.h"
+#include "fvdk_internal.h"
+#include "fvdk_ioctl.h"
+#include <linux/platform_device.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+
+#if KERNEL_VERSION(4, 17, 0) > LINUX_VERSION_CODE
+typedef int vm_fault_t;
+#endif
+
+#define BLOB_VM_FLAGS	(VM_DONTEXPAND | VM_DONTDUMP)
+
+static unsigned int blob_max_mb = 64;
+module_param(blob_max_mb, uint, 0444);
+MODULE_PARM_DESC(blob_max_mb, "Largest blob in MiB");
+
+// A user mapping of the blob, vm_private_data of the vma
+struct fvdk_blob_vma {
+	struct list_head list;
+	struct fvdkdata *data;
+	struct vm_area_struct *vma;
+};
+
+/*
+ * Protects the export lists and fvdk_blob_range.blob. A dma-buf can
+ * outlive the device, so its release can't rely on the blob lock.
+ * Nests inside the blob lock.
+ */
+static DEFINE_MUTEX(exportLock);
+
+void initFvdkBlob(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	mutex_init(&data->blob.lock);
+	mutex_init(&data->blob.ckptLock);
+	INIT_LIST_HEAD(&data->blob.regions);
+	INIT_LIST_HEAD(&data->blob.vmas);
+	INIT_LIST_HEAD(&data->blob.exports);
+}
+
+/**
+ * Create the blob, a no-op if it already exists
+ *
+ * @param size requested size, rounded up to whole pages
+ *
+ * @return 0 on success, <0 on error
+ */
+int createFvdkBlob(struct device *dev, size_t size)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_blob *blob = &data->blob;
+	unsigned long npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	int ret = 0;
+
+	mutex_lock(&blob->lock);
+	// An existing blob is returned whatever the size, as before
+	if (blob->pages)
+		goto out;
+	if (npages == 0 || size > (size_t)blob_max_mb << 20) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (blob->persistPages && npages > blob->persistPages) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	blob->pages = kvmalloc_array(npages, sizeof(*blob->pages),
+				     GFP_KERNEL | __GFP_ZERO);
+	blob->dirty = kvmalloc_array(BITS_TO_LONGS(npages), sizeof(long),
+				     GFP_KERNEL);
+	if (!blob->pages || !blob->dirty) {
+		dev_err(dev, "FVDK : Error allocating memory\n");
+		kvfree(blob->pages);
+		kvfree(blob->dirty);
+		blob->pages = NULL;
+		blob->dirty = NULL;
+		ret = -ENOMEM;
+		goto out;
+	}
+	// Nothing is checkpointed yet
+	bitmap_fill(blob->dirty, npages);
+	blob->npages = npages;
+out:
+	mutex_unlock(&blob->lock);
+	return ret;
+}
+
+void freeFvdkBlob(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_blob *blob = &data->blob;
+	struct fvdk_blob_range *range, *next;
+	unsigned long i;
+
+	mutex_lock(&blob->lock);
+	// Exports keep their page references
+	mutex_lock(&exportLock);
+	list_for_each_entry_safe(range, next, &blob->exports, list) {
+		list_del(&range->list);
+		range->blob = NULL;
+	}
+	mutex_unlock(&exportLock);
+
+	saveFvdkPersist(blob);
+	for (i = 0; i < blob->npages; i++)
+		if (blob->pages[i])
+			put_page(blob->pages[i]);
+	freeFvdkRegions(blob);
+	kvfree(blob->pages);
+	kvfree(blob->dirty);
+	blob->pages = NULL;
+	blob->dirty = NULL;
+	blob->npages = 0;
+	blob->allocated = 0;
+	blob->persistValid = 0;
+	blob->restored = FALSE;
+	mutex_unlock(&blob->lock);
+}
+
+// Grow the page array and bitmaps, call with lock held
+static int blobGrow(struct fvdk_blob *blob, unsigned long npages)
+{
+	struct page **pages;
+	unsigned long *dirty;
+
+	pages = kvmalloc_array(npages, sizeof(*pages), GFP_KERNEL | __GFP_ZERO);
+	dirty = kvmalloc_array(BITS_TO_LONGS(npages), sizeof(long), GFP_KERNEL);
+	if (!pages || !dirty) {
+		kvfree(pages);
+		kvfree(dirty);
+		return -ENOMEM;
+	}
+
+	// Faults hold the lock, so the arrays can be swapped under them
+	memcpy(pages, blob->pages, blob->npages * sizeof(*pages));
+	bitmap_copy(dirty, blob->dirty, blob->npages);
+	// bitmap_copy() rounds up to whole longs
+	bitmap_set(dirty, blob->npages, npages - blob->npages);
+	kvfree(blob->pages);
+	kvfree(blob->dirty);
+	blob->pages = pages;
+	blob->dirty = dirty;
+	blob->npages = npages;
+	return 0;
+}
+
+// Free the pages beyond npages, call with lock held
+static void blobShrink(struct fvdk_blob *blob, unsigned long npages)
+{
+	unsigned long i;
+
+	for (i = npages; i < blob->npages; i++) {
+		if (!blob->pages[i])
+			continue;
+		put_page(blob->pages[i]);
+		blob->pages[i] = NULL;
+		blob->allocated--;
+	}
+
+	// The arrays keep their size, the next grow replaces them
+	blob->npages = npages;
+	blob->persistValid = min(blob->persistValid, npages);
+}
+
+/**
+ * Check if a user mapping reaches into pages first to end - 1.
+ * Call with lock held.
+ */
+BOOL fvdkBlobMapped(struct fvdk_blob *blob, unsigned long first,
+		    unsigned long end)
+{
+	struct fvdk_blob_vma *bv;
+
+	list_for_each_entry(bv, &blob->vmas, list)
+		if (bv->vma->vm_pgoff < end &&
+		    bv->vma->vm_pgoff + vma_pages(bv->vma) > first)
+			return TRUE;
+	return FALSE;
+}
+
+// Check if a dma-buf export holds pages from first on, call with lock held
+static BOOL blobExported(struct fvdk_blob *blob, unsigned long first)
+{
+	struct fvdk_blob_range *range;
+	BOOL found = FALSE;
+
+	mutex_lock(&exportLock);
+	list_for_each_entry(range, &blob->exports, list)
+		if (range->first + range->npages > first) {
+			found = TRUE;
+			break;
+		}
+	mutex_unlock(&exportLock);
+	return found;
+}
+
+/**
+ * Resize the blob, keeping its contents and existing mappings
+ *
+ * @param size new size, rounded up to whole pages
+ *
+ * @return 0 on success, -EBUSY if a shrink would cut off a mapping,
+ *         export or region, <0 on other errors
+ */
+int resizeFvdkBlob(struct device *dev, u64 size)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_blob *blob = &data->blob;
+	unsigned long npages;
+	int ret = 0;
+
+	if (size == 0 || size > (u64)blob_max_mb << 20)
+		return -EINVAL;
+	npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+
+	mutex_lock(&blob->lock);
+	if (!blob->pages) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	if (npages > blob->npages) {
+		if (blob->persistPages && npages > blob->persistPages)
+			ret = -ENOSPC;
+		else
+			ret = blobGrow(blob, npages);
+		goto out;
+	}
+
+	if (fvdkBlobMapped(blob, npages, ULONG_MAX) ||
+	    blobExported(blob, npages) || fvdkRegionsEnd(blob) > npages) {
+		ret = -EBUSY;
+		goto out;
+	}
+	blobShrink(blob, npages);
+out:
+	mutex_unlock(&blob->lock);
+	return ret;
+}
+
+// Get blob page, allocated and zeroed on first use. Call with lock held.
+static struct page *blobPage(struct fvdk_blob *blob, unsigned long index)
+{
+	struct page *page = blob->pages[index];
+
+	if (!page && blob->persistPages) {
+		// Reserved pages, the reference keeps them out of the allocator
+		page = pfn_to_page(blob->persistPfn + index);
+		get_page(page);
+		if (index >= blob->persistValid)
+			clear_highpage(page);
+		blob->pages[index] = page;
+		blob->allocated++;
+		return page;
+	}
+	if (!page) {
+		page = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+		blob->pages[index] = page;
+		if (page)
+			blob->allocated++;
+	}
+	return page;
+}
+
+// Get references to a range of blob pages, call with lock held
+static int blobGetPages(struct fvdk_blob *blob, unsigned long first,
+			unsigned long count, struct page **pages)
+{
+	unsigned long i;
+
+	if (first >= blob->npages || count > blob->npages - first)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		pages[i] = blobPage(blob, first + i);
+		if (!pages[i]) {
+			while (i--)
+				put_page(pages[i]);
+			return -ENOMEM;
+		}
+		get_page(pages[i]);
+	}
+	return 0;
+}
+
+/**
+ * Get references to a range of blob pages, allocating missing ones
+ *
+ * @param pages returns count pages, put_page() each when done
+ *
+ * @return 0 on success, <0 on error
+ */
+int getFvdkBlobPages(struct device *dev, unsigned long first,
+		     unsigned long count, struct page **pages)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_blob *blob = &data->blob;
+	int ret;
+
+	mutex_lock(&blob->lock);
+	ret = blobGetPages(blob, first, count, pages);
+	mutex_unlock(&blob->lock);
+	return ret;
+}
+
+/**
+ * Get references to the pages of a dma-buf export and track it, so the
+ * blob isn't shrunk under it. Undo with putFvdkBlobExport().
+ *
+ * @param range first page and page count, linked on success
+ * @param pages returns the pages, put_page() each when done
+ *
+ * @return 0 on success, <0 on error
+ */
+int getFvdkBlobExport(struct device *dev, struct fvdk_blob_range *range,
+		      struct page **pages)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_blob *blob = &data->blob;
+	int ret;
+
+	mutex_lock(&blob->lock);
+	ret = blobGetPages(blob, range->first, range->npages, pages);
+	if (ret == 0) {
+		mutex_lock(&exportLock);
+		range->blob = blob;
+		list_add(&range->list, &blob->exports);
+		mutex_unlock(&exportLock);
+	}
+	mutex_unlock(&blob->lock);
+	return ret;
+}
+
+/**
+ * Stop tracking an export, safe after the device is gone
+ */
+void putFvdkBlobExport(struct fvdk_blob_range *range)
+{
+	mutex_lock(&exportLock);
+	if (range->blob)
+		list_del(&range->list);
+	range->blob = NULL;
+	mutex_unlock(&exportLock);
+}
+
+static vm_fault_t fvdkBlobFault(struct vm_fault *vmf)
+{
+	struct fvdk_blob_vma *bv = vmf->vma->vm_private_data;
+	struct fvdk_blob *blob = &bv->data->blob;
+	vm_fault_t ret = 0;
+	struct page *page;
+
+	mutex_lock(&blob->lock);
+	if (vmf->pgoff >= blob->npages) {
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+
+	page = blobPage(blob, vmf->pgoff);
+	if (!page) {
+		ret = VM_FAULT_OOM;
+		goto out;
+	}
+
+	// Reference for the page table, dropped on unmap
+	get_page(page);
+	vmf->page = page;
+out:
+	mutex_unlock(&blob->lock);
+	return ret;
+}
+
+/**
+ * First write to a page since it was mapped or last checkpointed
+ */
+static vm_fault_t fvdkBlobMkwrite(struct vm_fault *vmf)
+{
+	struct fvdk_blob_vma *bv = vmf->vma->vm_private_data;
+	struct fvdk_blob *blob = &bv->data->blob;
+	struct page *page = vmf->page;
+
+	// Returned locked, the core would wait for a page cache mapping
+	lock_page(page);
+	mutex_lock(&blob->lock);
+	if (vmf->pgoff >= blob->npages || blob->pages[vmf->pgoff] != page) {
+		// Shrunk or grown under us, fault again
+		mutex_unlock(&blob->lock);
+		unlock_page(page);
+		return VM_FAULT_NOPAGE;
+	}
+	set_bit(vmf->pgoff, blob->dirty);
+	mutex_unlock(&blob->lock);
+	return VM_FAULT_LOCKED;
+}
+
+/*
+ * The PTEs are write protected in place, readers keep their mappings.
+ * wp_shared_mapping_range() walks the mapping under the i_mmap lock,
+ * so it doesn't need the mmap locks that faults take before the blob
+ * lock. It only exists with CONFIG_MAPPING_DIRTY_HELPERS (5.8), other
+ * kernels unmap the pages and take a read fault per page as well.
+ */
+#if IS_ENABLED(CONFIG_MAPPING_DIRTY_HELPERS) && \
+	KERNEL_VERSION(5, 8, 0) <= LINUX_VERSION_CODE
+#define FVDK_BLOB_WRPROTECT
+#endif
+
+/**
+ * Write protect all user mappings again, so the next write to each
+ * page is seen. Call with lock held.
+ */
+void protectFvdkBlob(struct fvdk_blob *blob)
+{
+	struct fvdk_blob_vma *bv;
+
+	list_for_each_entry(bv, &blob->vmas, list)
+#ifdef FVDK_BLOB_WRPROTECT
+		wp_shared_mapping_range(bv->vma->vm_file->f_mapping,
+					bv->vma->vm_pgoff, vma_pages(bv->vma));
+#else
+		unmap_mapping_range(bv->vma->vm_file->f_mapping,
+				    (loff_t)bv->vma->vm_pgoff << PAGE_SHIFT,
+				    bv->vma->vm_end - bv->vma->vm_start, 1);
+#endif
+}
+
+// Track the vma, call with lock held
+static void blobAddVma(struct fvdk_blob *blob, struct fvdk_blob_vma *bv,
+		       struct vm_area_struct *vma)
+{
+	bv->vma = vma;
+	vma->vm_private_data = bv;
+	list_add(&bv->list, &blob->vmas);
+}
+
+// Called for the copy of a vma on fork and for the new half of a split
+static void fvdkBlobVmOpen(struct vm_area_struct *vma)
+{
+	struct fvdk_blob_vma *old = vma->vm_private_data;
+	struct fvdk_blob *blob = &old->data->blob;
+	struct fvdk_blob_vma *bv;
+
+	// vm_ops->open can't fail
+	bv = kmalloc(sizeof(*bv), GFP_KERNEL | __GFP_NOFAIL);
+	bv->data = old->data;
+
+	mutex_lock(&blob->lock);
+	blobAddVma(blob, bv, vma);
+	mutex_unlock(&blob->lock);
+}
+
+static void fvdkBlobVmClose(struct vm_area_struct *vma)
+{
+	struct fvdk_blob_vma *bv = vma->vm_private_data;
+	struct fvdk_blob *blob = &bv->data->blob;
+
+	mutex_lock(&blob->lock);
+	list_del(&bv->list);
+	mutex_unlock(&blob->lock);
+	kfree(bv);
+}
+
+static const struct vm_operations_struct fvdk_blob_vm_ops = {
+	.open = fvdkBlobVmOpen,
+	.close = fvdkBlobVmClose,
+	.fault = fvdkBlobFault,
+	.page_mkwrite = fvdkBlobMkwrite,
+};
+
+/**
+ * Get blob size and how much of it is allocated
+ */
+void getFvdkBlobInfo(struct device *dev, struct fvdk_blob_info *info)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_blob *blob = &data->blob;
+
+	mutex_lock(&blob->lock);
+	info->size = (__u64)blob->npages << PAGE_SHIFT;
+	info->pages = blob->allocated;
+	info->flags = 0;
+	if (blob->persistPages)
+		info->flags |= FVDK_BLOB_PERSISTENT;
+	if (blob->restored)
+		info->flags |= FVDK_BLOB_RESTORED;
+	mutex_unlock(&blob->lock);
+}
+
+/**
+ * Map the blob, pages are filled in on fault. Only MAP_SHARED
+ * mappings are allowed.
+ *
+ * @return 0 on success, -EINVAL for a private mapping or one past the
+ *         end of the blob
+ */
+int mapFvdkBlob(struct device *dev, struct vm_area_struct *vma)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	unsigned long npages = vma_pages(vma);
+	struct fvdk_blob_vma *bv;
+
+	// A private mapping would copy on write instead of sharing the blob
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	bv = kmalloc(sizeof(*bv), GFP_KERNEL);
+	if (!bv)
+		return -ENOMEM;
+	bv->data = data;
+
+	mutex_lock(&data->blob.lock);
+	if (vma->vm_pgoff + npages > data->blob.npages) {
+		mutex_unlock(&data->blob.lock);
+		kfree(bv);
+		return -EINVAL;
+	}
+	blobAddVma(&data->blob, bv, vma);
+	mutex_unlock(&data->blob.lock);
+
+#if KERNEL_VERSION(6, 3, 0) <= LINUX_VERSION_CODE
+	vm_flags_set(vma, BLOB_VM_FLAGS);
+#else
+	vma->vm_flags |= BLOB_VM_FLAGS;
+#endif
+	vma->vm_ops = &fvdk_blob_vm_ops;
+	return 0;
+}
@@ -0,0 +1,266 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ *    FLIR Video Device driver.
+ *    Blob checkpoint and restore
+ *
+ *    A checkpoint file is a header page followed by the blob pages in
+ *    order. Only pages written since the last checkpoint are written,
+ *    so repeated checkpoints to the same file cost little. Writes are
+ *    seen through write faults on the user mappings; writes by devices
+ *    to exported dma-bufs are not, use FVDK_CHECKPOINT_FULL for those.
+ *
+ *    The header is cleared and synced before any page is written, and
+ *    written again after the pages are synced. A file left behind by an
+ *    interrupted checkpoint has no valid header and is not restored.
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "flir_kernel_os.h"
+#include "fpga.h"
+#include "fvdk_internal.h"
+#include "fvdk_ioctl.h"
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+
+#define FVDK_CHECKPOINT_MAGIC	0x43445646	// "FVDC"
+#define FVDK_CHECKPOINT_VERSION	1
+
+struct fvdk_checkpoint_header {
+	__le32 magic;
+	__le32 version;
+	__le32 page_size;
+	__le32 reserved;
+	__le64 size;		// Blob size in bytes
+};
+
+static int writePage(struct file *file, struct page *page, unsigned long index)
+{
+	loff_t pos = (loff_t)(index + 1) << PAGE_SHIFT;
+	void *p = kmap(page);
+	ssize_t n;
+
+	n = kernel_write(file, p, PAGE_SIZE, &pos);
+	kunmap(page);
+	if (n < 0)
+		return n;
+	return n == PAGE_SIZE ? 0 : -EIO;
+}
+
+// Write the header and sync the file, a zeroed header marks it incomplete
+static int writeHeader(struct file *file,
+		       const struct fvdk_checkpoint_header *hdr)
+{
+	loff_t pos = 0;
+	ssize_t n;
+
+	n = kernel_write(file, hdr, sizeof(*hdr), &pos);
+	if (n != sizeof(*hdr))
+		return n < 0 ? n : -EIO;
+	return vfs_fsync(file, 0);
+}
+
+/**
+ * Write the blob pages dirtied since the last checkpoint to a file
+ *
+ * @param req file descriptor and flags, returns pages written
+ *
+ * @return 0 on success, <0 on error
+ */
+int checkpointFvdkBlob(struct device *dev, struct fvdk_blob_checkpoint *req)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_blob *blob = &data->blob;
+	struct fvdk_checkpoint_header hdr = { };
+	unsigned long *dirty = NULL;
+	unsigned long npages, i;
+	struct page *page;
+	struct file *file;
+	int ret = 0;
+
+	if (req->flags & ~FVDK_CHECKPOINT_FULL)
+		return -EINVAL;
+	file = fget(req->fd);
+	if (!file)
+		return -EBADF;
+	if (!(file->f_mode & FMODE_WRITE)) {
+		ret = -EBADF;
+		goto out_file;
+	}
+	req->pages = 0;
+
+	mutex_lock(&blob->ckptLock);
+	mutex_lock(&blob->lock);
+	npages = blob->npages;
+	if (!npages) {
+		mutex_unlock(&blob->lock);
+		ret = -ENODEV;
+		goto out;
+	}
+	dirty = kvmalloc_array(BITS_TO_LONGS(npages), sizeof(long), GFP_KERNEL);
+	if (!dirty) {
+		mutex_unlock(&blob->lock);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	// Take the dirty set and make the next write to each page fault
+	if (req->flags & FVDK_CHECKPOINT_FULL)
+		bitmap_fill(dirty, npages);
+	else
+		bitmap_copy(dirty, blob->dirty, npages);
+	bitmap_zero(blob->dirty, npages);
+	protectFvdkBlob(blob);
+	mutex_unlock(&blob->lock);
+
+	// The pages on file no longer match the old header
+	ret = writeHeader(file, &hdr);
+	if (ret)
+		goto out_dirty;
+
+	for_each_set_bit(i, dirty, npages) {
+		mutex_lock(&blob->lock);
+		page = i < blob->npages ? blob->pages[i] : NULL;
+		if (page)
+			get_page(page);
+		mutex_unlock(&blob->lock);
+
+		// Pages never faulted in read as zeroes
+		ret = writePage(file, page ? page : ZERO_PAGE(0), i);
+		if (page)
+			put_page(page);
+		if (ret)
+			goto out_dirty;
+		req->pages++;
+		cond_resched();
+	}
+
+	// Header last, once the pages are on disk
+	ret = vfs_fsync(file, 0);
+	if (ret)
+		goto out_dirty;
+	hdr.magic = cpu_to_le32(FVDK_CHECKPOINT_MAGIC);
+	hdr.version = cpu_to_le32(FVDK_CHECKPOINT_VERSION);
+	hdr.page_size = cpu_to_le32(PAGE_SIZE);
+	hdr.size = cpu_to_le64((u64)npages << PAGE_SHIFT);
+	ret = writeHeader(file, &hdr);
+	if (!ret)
+		goto out;
+
+out_dirty:
+	// Not safely in the file, keep them for the next checkpoint
+	mutex_lock(&blob->lock);
+	bitmap_or(blob->dirty, blob->dirty, dirty, min(npages, blob->npages));
+	mutex_unlock(&blob->lock);
+out:
+	mutex_unlock(&blob->ckptLock);
+	kvfree(dirty);
+out_file:
+	fput(file);
+	return ret;
+}
+
+/**
+ * Load the blob from a checkpoint file. Creates the blob if it does
+ * not exist, otherwise the sizes must match. The blob then matches
+ * the file, so it starts out clean.
+ *
+ * @return 0 on success, <0 on error
+ */
+int restoreFvdkBlob(struct device *dev, s32 fd)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_blob *blob = &data->blob;
+	struct fvdk_checkpoint_header hdr;
+	struct page **pages;
+	unsigned long npages, i;
+	struct file *file;
+	loff_t pos = 0;
+	ssize_t n;
+	u64 size;
+	int ret;
+
+	file = fget(fd);
+	if (!file)
+		return -EBADF;
+	if (!(file->f_mode & FMODE_READ)) {
+		ret = -EBADF;
+		goto out_file;
+	}
+
+	n = kernel_read(file, &hdr, sizeof(hdr), &pos);
+	if (n != sizeof(hdr) || le32_to_cpu(hdr.magic) != FVDK_CHECKPOINT_MAGIC ||
+	    le32_to_cpu(hdr.version) != FVDK_CHECKPOINT_VERSION ||
+	    le32_to_cpu(hdr.page_size) != PAGE_SIZE) {
+		ret = n < 0 ? n : -EINVAL;
+		goto out_file;
+	}
+	size = le64_to_cpu(hdr.size);
+	if (!size || size > SIZE_MAX) {
+		ret = -EINVAL;
+		goto out_file;
+	}
+	// A truncated file would restore zeroes in place of missing pages
+	if (i_size_read(file_inode(file)) < PAGE_ALIGN(size) + PAGE_SIZE) {
+		ret = -EINVAL;
+		goto out_file;
+	}
+
+	mutex_lock(&blob->ckptLock);
+	ret = createFvdkBlob(dev, size);
+	if (ret)
+		goto out;
+	mutex_lock(&blob->lock);
+	npages = blob->npages;
+	mutex_unlock(&blob->lock);
+	if ((u64)npages << PAGE_SHIFT != size) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	pages = kvmalloc_array(npages, sizeof(*pages), GFP_KERNEL);
+	if (!pages) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = getFvdkBlobPages(dev, 0, npages, pages);
+	if (ret) {
+		kvfree(pages);
+		goto out;
+	}
+
+	// One sequential read of the whole file
+	for (i = 0; i < npages && !ret; i++) {
+		void *p = kmap(pages[i]);
+
+		pos = (loff_t)(i + 1) << PAGE_SHIFT;
+		n = kernel_read(file, p, PAGE_SIZE, &pos);
+		kunmap(pages[i]);
+		flush_dcache_page(pages[i]);
+		// Truncated since the size was checked
+		if (n != PAGE_SIZE)
+			ret = n < 0 ? n : -EIO;
+		cond_resched();
+	}
+	for (i = 0; i < npages; i++)
+		put_page(pages[i]);
+	kvfree(pages);
+
+	if (!ret) {
+		mutex_lock(&blob->lock);
+		bitmap_zero(blob->dirty, blob->npages);
+		protectFvdkBlob(blob);
+		mutex_unlock(&blob->lock);
+	}
+out:
+	mutex_unlock(&blob->ckptLock);
+out_file:
+	fput(file);
+	return ret;
+}
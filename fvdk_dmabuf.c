@@ -0,0 +1,334 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ *    FLIR Video Device driver.
+ *    dma-buf export of the blob
+ *
+ *    An exported region holds references to its blob pages, so it
+ *    stays valid for as long as the dma-buf lives. The blob tracks the
+ *    export and is not shrunk below it meanwhile. CPU access through
+ *    the dma-buf mmap is bracketed by DMA_BUF_IOCTL_SYNC, which syncs
+ *    the mappings of all attached devices.
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "flir_kernel_os.h"
+#include "fpga.h"
+#include "fvdk_internal.h"
+#include "fvdk_ioctl.h"
+#include <linux/platform_device.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/fcntl.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+
+#if KERNEL_VERSION(6, 13, 0) <= LINUX_VERSION_CODE
+MODULE_IMPORT_NS("DMA_BUF");
+#elif KERNEL_VERSION(5, 16, 0) <= LINUX_VERSION_CODE
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
+
+struct fvdk_dmabuf {
+	struct page **pages;
+	unsigned long npages;
+	struct fvdk_blob_range range;
+	struct mutex lock;		// Protects attachments
+	struct list_head attachments;
+};
+
+struct fvdk_dmabuf_attachment {
+	struct list_head list;
+	struct device *dev;
+	struct sg_table *sgt;		// NULL while not mapped
+	enum dma_data_direction dir;
+};
+
+static int fvdkDmabufAttach(struct dma_buf *dmabuf,
+#if KERNEL_VERSION(4, 19, 0) > LINUX_VERSION_CODE
+			    struct device *dev,
+#endif
+			    struct dma_buf_attachment *attach)
+{
+	struct fvdk_dmabuf *buf = dmabuf->priv;
+	struct fvdk_dmabuf_attachment *a;
+
+	a = kzalloc(sizeof(*a), GFP_KERNEL);
+	if (!a)
+		return -ENOMEM;
+
+	a->dev = attach->dev;
+	attach->priv = a;
+
+	mutex_lock(&buf->lock);
+	list_add(&a->list, &buf->attachments);
+	mutex_unlock(&buf->lock);
+	return 0;
+}
+
+static void fvdkDmabufDetach(struct dma_buf *dmabuf,
+			     struct dma_buf_attachment *attach)
+{
+	struct fvdk_dmabuf *buf = dmabuf->priv;
+	struct fvdk_dmabuf_attachment *a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	list_del(&a->list);
+	mutex_unlock(&buf->lock);
+	kfree(a);
+}
+
+static struct sg_table *fvdkDmabufMap(struct dma_buf_attachment *attach,
+				      enum dma_data_direction dir)
+{
+	struct fvdk_dmabuf *buf = attach->dmabuf->priv;
+	struct fvdk_dmabuf_attachment *a = attach->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	ret = sg_alloc_table_from_pages(sgt, buf->pages, buf->npages, 0,
+					buf->npages << PAGE_SHIFT, GFP_KERNEL);
+	if (ret)
+		goto err_free;
+
+#if KERNEL_VERSION(5, 8, 0) <= LINUX_VERSION_CODE
+	ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+#else
+	sgt->nents = dma_map_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir);
+	ret = sgt->nents ? 0 : -EIO;
+#endif
+	if (ret)
+		goto err_table;
+
+	mutex_lock(&buf->lock);
+	a->sgt = sgt;
+	a->dir = dir;
+	mutex_unlock(&buf->lock);
+	return sgt;
+
+err_table:
+	sg_free_table(sgt);
+err_free:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void fvdkDmabufUnmap(struct dma_buf_attachment *attach,
+			    struct sg_table *sgt, enum dma_data_direction dir)
+{
+	struct fvdk_dmabuf *buf = attach->dmabuf->priv;
+	struct fvdk_dmabuf_attachment *a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	a->sgt = NULL;
+	mutex_unlock(&buf->lock);
+
+#if KERNEL_VERSION(5, 8, 0) <= LINUX_VERSION_CODE
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+#else
+	dma_unmap_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir);
+#endif
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void fvdkDmabufRelease(struct dma_buf *dmabuf)
+{
+	struct fvdk_dmabuf *buf = dmabuf->priv;
+	unsigned long i;
+
+	putFvdkBlobExport(&buf->range);
+	for (i = 0; i < buf->npages; i++)
+		put_page(buf->pages[i]);
+	kvfree(buf->pages);
+	kfree(buf);
+}
+
+static int fvdkDmabufMmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct fvdk_dmabuf *buf = dmabuf->priv;
+	unsigned long addr = vma->vm_start;
+	unsigned long i;
+	int ret;
+
+	// The dma-buf core has checked the range against the size
+	for (i = vma->vm_pgoff; addr < vma->vm_end; i++, addr += PAGE_SIZE) {
+		ret = vm_insert_page(vma, addr, buf->pages[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/**
+ * Make device writes visible to the CPU before CPU access
+ */
+static int fvdkDmabufBeginCpu(struct dma_buf *dmabuf,
+			      enum dma_data_direction dir)
+{
+	struct fvdk_dmabuf *buf = dmabuf->priv;
+	struct fvdk_dmabuf_attachment *a;
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, list)
+		if (a->sgt)
+			dma_sync_sg_for_cpu(a->dev, a->sgt->sgl,
+					    a->sgt->orig_nents, a->dir);
+	mutex_unlock(&buf->lock);
+	return 0;
+}
+
+/**
+ * Make CPU writes visible to the devices after CPU access
+ */
+static int fvdkDmabufEndCpu(struct dma_buf *dmabuf,
+			    enum dma_data_direction dir)
+{
+	struct fvdk_dmabuf *buf = dmabuf->priv;
+	struct fvdk_dmabuf_attachment *a;
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, list)
+		if (a->sgt)
+			dma_sync_sg_for_device(a->dev, a->sgt->sgl,
+					       a->sgt->orig_nents, a->dir);
+	mutex_unlock(&buf->lock);
+	return 0;
+}
+
+#if KERNEL_VERSION(5, 6, 0) > LINUX_VERSION_CODE
+static void *fvdkDmabufKmap(struct dma_buf *dmabuf, unsigned long page_num)
+{
+	struct fvdk_dmabuf *buf = dmabuf->priv;
+
+	return kmap(buf->pages[page_num]);
+}
+
+static void fvdkDmabufKunmap(struct dma_buf *dmabuf, unsigned long page_num,
+			     void *addr)
+{
+	struct fvdk_dmabuf *buf = dmabuf->priv;
+
+	kunmap(buf->pages[page_num]);
+}
+#endif
+
+#if KERNEL_VERSION(4, 19, 0) > LINUX_VERSION_CODE
+static void *fvdkDmabufKmapAtomic(struct dma_buf *dmabuf,
+				  unsigned long page_num)
+{
+	struct fvdk_dmabuf *buf = dmabuf->priv;
+
+	return kmap_atomic(buf->pages[page_num]);
+}
+
+static void fvdkDmabufKunmapAtomic(struct dma_buf *dmabuf,
+				   unsigned long page_num, void *addr)
+{
+	kunmap_atomic(addr);
+}
+#endif
+
+static const struct dma_buf_ops fvdk_dmabuf_ops = {
+	.attach = fvdkDmabufAttach,
+	.detach = fvdkDmabufDetach,
+	.map_dma_buf = fvdkDmabufMap,
+	.unmap_dma_buf = fvdkDmabufUnmap,
+	.release = fvdkDmabufRelease,
+	.mmap = fvdkDmabufMmap,
+	.begin_cpu_access = fvdkDmabufBeginCpu,
+	.end_cpu_access = fvdkDmabufEndCpu,
+#if KERNEL_VERSION(5, 6, 0) > LINUX_VERSION_CODE
+	.map = fvdkDmabufKmap,
+	.unmap = fvdkDmabufKunmap,
+#endif
+#if KERNEL_VERSION(4, 19, 0) > LINUX_VERSION_CODE
+	.map_atomic = fvdkDmabufKmapAtomic,
+	.unmap_atomic = fvdkDmabufKunmapAtomic,
+#endif
+};
+
+/**
+ * Export a page aligned region of the blob as a dma-buf
+ *
+ * @param req region, returns the dma-buf fd
+ *
+ * @return 0 on success, <0 on error
+ */
+int exportFvdkBlob(struct device *dev, struct fvdk_blob_export *req)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct fvdk_dmabuf *buf;
+	struct dma_buf *dmabuf;
+	u64 size;
+	int ret;
+
+	if (!req->size || !PAGE_ALIGNED(req->offset) || !PAGE_ALIGNED(req->size) ||
+	    req->flags & ~(O_CLOEXEC | O_ACCMODE))
+		return -EINVAL;
+
+	// Checked in 64 bits before narrowing to unsigned long and size_t,
+	// and again under the blob lock by getFvdkBlobExport()
+	size = (u64)READ_ONCE(data->blob.npages) << PAGE_SHIFT;
+	if (req->offset >= size || req->size > size - req->offset)
+		return -EINVAL;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	mutex_init(&buf->lock);
+	INIT_LIST_HEAD(&buf->attachments);
+
+	buf->npages = req->size >> PAGE_SHIFT;
+	buf->pages = kvmalloc_array(buf->npages, sizeof(*buf->pages), GFP_KERNEL);
+	if (!buf->pages) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	buf->range.first = req->offset >> PAGE_SHIFT;
+	buf->range.npages = buf->npages;
+	ret = getFvdkBlobExport(dev, &buf->range, buf->pages);
+	if (ret)
+		goto err_pages;
+
+	exp_info.ops = &fvdk_dmabuf_ops;
+	exp_info.size = req->size;
+	exp_info.flags = req->flags & O_ACCMODE;
+	exp_info.priv = buf;
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		ret = PTR_ERR(dmabuf);
+		goto err_put;
+	}
+
+	// From here the release callback owns buf
+	ret = dma_buf_fd(dmabuf, req->flags & O_CLOEXEC);
+	if (ret < 0) {
+		dma_buf_put(dmabuf);
+		return ret;
+	}
+	req->fd = ret;
+	return 0;
+
+err_put:
+	putFvdkBlobExport(&buf->range);
+	while (buf->npages--)
+		put_page(buf->pages[buf->npages]);
+err_pages:
+	kvfree(buf->pages);
+err_free:
+	kfree(buf);
+	return ret;
+}
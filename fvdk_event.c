@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ *    FLIR Video Device driver.
+ *    Event notification, poll() and eventfd
+ *
+ *    Events are latched per open file until read with
+ *    IOCTL_FVDK_GET_EVENTS. A file with pending events polls readable,
+ *    and a registered eventfd is signalled as they are raised.
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "flir_kernel_os.h"
+#include "fpga.h"
+#include "fvdk_internal.h"
+#include "fvdk_ioctl.h"
+#include <linux/platform_device.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/interrupt.h>
+#include <linux/gpio.h>
+
+void initFvdkEvents(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	spin_lock_init(&data->eventLock);
+	INIT_LIST_HEAD(&data->files);
+	init_waitqueue_head(&data->eventWait);
+}
+
+// Call with eventLock held
+static void raiseEvents(struct fvdk_file *ctx, u32 events)
+{
+	if (!(events & ctx->mask))
+		return;
+	ctx->pending |= events & ctx->mask;
+	if (ctx->eventfd)
+#if KERNEL_VERSION(6, 8, 0) <= LINUX_VERSION_CODE
+		eventfd_signal(ctx->eventfd);
+#else
+		eventfd_signal(ctx->eventfd, 1);
+#endif
+}
+
+/**
+ * Raise events to all open files
+ *
+ * @param events FVDK_EV_* mask
+ */
+void fvdkEvent(struct device *dev, u32 events)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_file *ctx;
+	unsigned long flags;
+
+	spin_lock_irqsave(&data->eventLock, flags);
+	list_for_each_entry(ctx, &data->files, list)
+		raiseEvents(ctx, events);
+	spin_unlock_irqrestore(&data->eventLock, flags);
+
+	wake_up_interruptible(&data->eventWait);
+}
+
+/**
+ * Raise events to one open file
+ *
+ * @param events FVDK_EV_* mask
+ */
+void fvdkFileEvent(struct fvdk_file *ctx, u32 events)
+{
+	struct fvdkdata *data = ctx->data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&data->eventLock, flags);
+	raiseEvents(ctx, events);
+	spin_unlock_irqrestore(&data->eventLock, flags);
+
+	wake_up_interruptible(&data->eventWait);
+}
+
+void addFvdkFile(struct fvdkdata *data, struct fvdk_file *ctx)
+{
+	unsigned long flags;
+
+	ctx->data = data;
+	ctx->mask = FVDK_EV_ALL;
+
+	spin_lock_irqsave(&data->eventLock, flags);
+	list_add_tail(&ctx->list, &data->files);
+	spin_unlock_irqrestore(&data->eventLock, flags);
+}
+
+void removeFvdkFile(struct fvdk_file *ctx)
+{
+	struct fvdkdata *data = ctx->data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&data->eventLock, flags);
+	list_del(&ctx->list);
+	spin_unlock_irqrestore(&data->eventLock, flags);
+
+	if (ctx->eventfd)
+		eventfd_ctx_put(ctx->eventfd);
+}
+
+/**
+ * Set the event mask of a file and register or drop its eventfd
+ *
+ * @return 0 on success, <0 on error
+ */
+int setFvdkEvents(struct fvdk_file *ctx, const struct fvdk_events *req)
+{
+	struct fvdkdata *data = ctx->data;
+	struct eventfd_ctx *efd = NULL;
+	struct eventfd_ctx *old;
+	unsigned long flags;
+
+	if (req->mask & ~FVDK_EV_ALL)
+		return -EINVAL;
+
+	if (req->fd >= 0) {
+		efd = eventfd_ctx_fdget(req->fd);
+		if (IS_ERR(efd))
+			return PTR_ERR(efd);
+	}
+
+	spin_lock_irqsave(&data->eventLock, flags);
+	old = ctx->eventfd;
+	ctx->eventfd = efd;
+	ctx->mask = req->mask;
+	ctx->pending &= req->mask;
+	spin_unlock_irqrestore(&data->eventLock, flags);
+
+	if (old)
+		eventfd_ctx_put(old);
+	return 0;
+}
+
+/**
+ * Fetch and clear the pending events of a file
+ */
+u32 getFvdkEvents(struct fvdk_file *ctx)
+{
+	struct fvdkdata *data = ctx->data;
+	unsigned long flags;
+	u32 events;
+
+	spin_lock_irqsave(&data->eventLock, flags);
+	events = ctx->pending;
+	ctx->pending = 0;
+	spin_unlock_irqrestore(&data->eventLock, flags);
+
+	return events;
+}
+
+unsigned int pollFvdkEvents(struct file *file, poll_table *wait)
+{
+	struct fvdk_file *ctx = file->private_data;
+	struct fvdkdata *data = ctx->data;
+
+	poll_wait(file, &data->eventWait, wait);
+
+	return READ_ONCE(ctx->pending) ? (POLLIN | POLLRDNORM) : 0;
+}
+
+static irqreturn_t fvdkReadyIrq(int irq, void *dev_id)
+{
+	updateFvdkPins(dev_id);
+	return IRQ_HANDLED;
+}
+
+/**
+ * Watch the READY pin for transitions. CONF_DONE is sampled along
+ * with it, the boards don't share a common CONF_DONE gpio.
+ * Without an interrupt, pin changes are only seen on load and power
+ * transitions.
+ */
+void watchFvdkPins(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	int gpio = data->fpga_pins.ready_gpio;
+	int irq, ret;
+
+	if (!gpio_is_valid(gpio))
+		return;
+
+	irq = gpio_to_irq(gpio);
+	if (irq < 0) {
+		dev_warn(dev, "No interrupt for READY pin (%d)\n", irq);
+		return;
+	}
+
+	ret = request_threaded_irq(irq, NULL, fvdkReadyIrq,
+				   IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING |
+				   IRQF_ONESHOT, "fvdk-ready", dev);
+	if (ret) {
+		dev_warn(dev, "Failed to request READY interrupt (%d)\n", ret);
+		return;
+	}
+	data->readyIrq = irq;
+}
+
+void unwatchFvdkPins(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	if (data->readyIrq)
+		free_irq(data->readyIrq, dev);
+	data->readyIrq = 0;
+}
@@ -68,6 +68,9 @@ BOOL SetupGpioAccessEOCO(struct device *dev)
 
 	ret = GetMainboardVersion(dev, &article, &revision);
 
+	// No READY pin on EOCO, keep the pin watcher off GPIO 0
+	data->fpga_pins.ready_gpio = -EINVAL;
+
 	data->fpga_pins.pin_fpga_ce_n = of_get_named_gpio(np, "fpga_ce_n", 0);
 	if (gpio_is_valid(data->fpga_pins.pin_fpga_ce_n)) {
 		ret = devm_gpio_request_one(dev, data->fpga_pins.pin_fpga_ce_n,
@@ -201,6 +204,8 @@ BOOL GetPinReadyEOCO(struct device *dev)
 {
 	struct fvdkdata *data = dev_get_drvdata(dev);
 
+	if (!gpio_is_valid(data->fpga_pins.ready_gpio))
+		return FALSE;
 	return (gpio_get_value(data->fpga_pins.ready_gpio) != 0);
 }
 
@@ -24,6 +24,15 @@
 #include <linux/proc_fs.h>
 #include <linux/regulator/consumer.h>
 #include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+struct vm_area_struct;
+struct poll_table_struct;
+struct eventfd_ctx;
 
 #define FVD_MINOR_VERSION   0
 #define FVD_MAJOR_VERSION   1
@@ -41,6 +50,9 @@ struct fvdk_ops {
 	void (*pBSPFvdPowerDown)(struct device *dev);
 	void (*pBSPFvdPowerDownFPA)(struct device *dev);
 	void (*pBSPFvdPowerUpFPA)(struct device *dev);
+
+	// Optional, replaces the SPI transfer of FPGA data (see fvdk_sim.c)
+	DWORD (*pWriteFpgaData)(struct device *dev, const void *buf, ULONG size);
 };
 
 struct fpga_pins {
@@ -57,22 +69,94 @@ struct fpga_pins {
 	int ready_gpio;
 };
 
+// Parsed FPGA header, generic + specific header and SDRAM buffer table
+struct fpga_header {
+	struct fvdk_header_map *map;	// Read only user mapping, vmalloc'ed
+	char *raw;		// Header data, inside map
+	size_t size;		// sizeof(GENERIC_FPGA_T) + spec_size
+	GENERIC_FPGA_T *pGen;
+	BXAB_FPGA_T *pSpec;	// NULL if spec_size is too small
+	SDRAM_BUF_T *pBuf;	// Buffer table following pSpec
+	ULONG noOfBuffers;	// Entries in pBuf, bounded by spec_size
+};
+
+// Fixed lock ids, named locks follow from FVDK_LOCKS
+enum locks { LNONE, LDRV, LEXEC, LLEPT };
+#define FVDK_LOCKS	(LLEPT + 1)
+
+struct fvdk_rtm;
+struct fvdk_proxy;
+struct fvdk_file;
+
+struct fvdk_lock {
+	__u32 *word;		// In the lock page, FVDK_LOCK_*
+	wait_queue_head_t wait;
+	spinlock_t spin;	// Protects the fields below
+	struct fvdk_rtm *rtm;	// rt_mutex taken by the owner, see fvdk_lock.c
+	struct fvdk_rtm *held;	// rtm held by the owner
+	struct fvdk_proxy *proxy;	// Holds held for the owner, or NULL
+	struct task_struct *owner;	// NULL if taken from user space
+	struct fvdk_file *file;	// Released when closed, NULL for the driver
+	struct list_head async;	// Queued asynchronous requests, FIFO
+	struct list_head shared;	// Shared holders
+	u32 readers;		// Shared holders, together holding the word
+	char name[32];		// FVDK_LOCK_NAME_LEN, set before rtm
+	u64 acquisitions;	// Statistics, through the driver only
+	u64 contended;
+	u64 waitNs;
+	u64 maxWaitNs;
+	BOOL orphaned;		// Released from a dead owner
+	u32 handoffs;		// Taken after a dead owner
+};
+
+// Blob pages held by a dma-buf export, see fvdk_dmabuf.c
+struct fvdk_blob_range {
+	struct list_head list;	// In fvdk_blob exports
+	struct fvdk_blob *blob;	// NULL once untracked
+	unsigned long first;
+	unsigned long npages;
+};
+
+// Region saved with a persistent blob, see fvdk_persist.c
+#define FVDK_PERSIST_REGIONS	64
+struct fvdk_persist_region {
+	char name[32];		// FVDK_REGION_NAME_LEN
+	__le64 first;		// Blob page index
+	__le64 npages;
+	__le64 align;
+};
+
+// Shared memory blob, see fvdk_blob.c
+struct fvdk_blob {
+	struct mutex lock;
+	struct page **pages;	// NULL until faulted in
+	unsigned long npages;
+	unsigned long allocated;	// Pages faulted in
+	struct list_head regions;	// Named regions, see fvdk_region.c
+	struct list_head vmas;		// User mappings
+	struct list_head exports;	// dma-buf exports, fvdk_blob_range
+	unsigned long persistPfn;	// First page in reserved memory
+	unsigned long persistPages;	// 0 unless in reserved memory
+	unsigned long persistValid;	// Pages restored, not to be cleared
+	BOOL restored;
+	unsigned long *dirty;		// Written since the last checkpoint
+	struct mutex ckptLock;		// Serialises checkpoint and restore
+};
+
 // this structure keeps track of the device instance
 typedef struct __FVD_DEV_INFO {
 	// Linux driver variables
 	BOOL fpgaLoaded;
 
 	// FPGA header
-	char fpga[400];		// FPGA Header data buffer
+	struct fpga_header fpga;	// Protected by muHeader
+	BOOL fpgaHeaderValid;	// fpga holds the current header
 
 	int spi_sclk_gpio;
 	int spi_mosi_gpio;
 	int spi_miso_gpio;
 	int spi_cs_gpio;
 
-	char *blob;
-	int blobsize;
-
 	//Configs
 	bool spi_flash;
 
@@ -88,6 +172,7 @@ struct fvdkdata {
 	struct miscdevice miscdev;
 	struct device *dev;
 	FVD_DEV_INFO pDev;
+	struct fvdk_blob blob;
 	//Regulators
 	struct regulator *reg_4v0_fpa;
 	struct regulator *reg_3v15_fpa;
@@ -104,26 +189,154 @@ struct fvdkdata {
 	struct pinctrl_state *pins_default;
 	struct pinctrl_state *pins_idle;
 
-	// Locks
-	struct semaphore muDevice;
-	struct semaphore muLepton;
-	struct semaphore muExecute;
+	// Locks, see fvdk_lock.c
+	__u32 *lockPage;
+	struct fvdk_lock *locks;	// nLocks, created ones have an rtm
+	u32 nLocks;
+	struct mutex muLocks;	// Serialises lock creation
+	struct list_head proxies;	// Lock wait threads
+	struct list_head idleProxies;
+	spinlock_t proxyLock;	// Protects the proxy lists
 	struct semaphore muStandby;
+	struct mutex muLoad;	// Serializes FPGA (re)configuration
+	struct mutex muHeader;	// Protects the FPGA header store
+
+	// Status page, see fvdk_status.c
+	struct fvdk_status *status;
+	spinlock_t statusLock;
+
+	// Events, see fvdk_event.c
+	spinlock_t eventLock;	// Protects files and their event state
+	struct list_head files;
+	wait_queue_head_t eventWait;
+	int readyIrq;
+
+	// Asynchronous power up
+	struct work_struct powerWork;
+	atomic_t powerSeq;	// Last sequence number handed out
+	atomic_t powerFlags;	// FVDK_POWER_* of queued requests
 
 	struct fpga_pins fpga_pins;
 };
 
+// Per open file
+struct fvdk_file {
+	struct fvdkdata *data;
+	struct list_head list;	// In fvdkdata files
+	u32 mask;		// FVDK_EV_* raised to this file
+	u32 pending;		// Raised and not yet read
+	struct eventfd_ctx *eventfd;
+};
+
 // Function prototypes to set up hardware specific items
 void SetupMX6S_ec101(struct device *dev);
 void SetupMX6S_ec501(struct device *dev);
 void Setup_FLIR_EOCO(struct device *dev);
 void Setup_FLIR_ec702(struct device *dev);
+void Setup_FVDK_Sim(struct device *dev);
 
 // Function prototypes for common FVD functions
 DWORD CheckFPGA(struct device *dev);
 DWORD LoadFPGA(struct device *dev, char *szFileName);
-PUCHAR getFPGAData(struct device *dev, ULONG *size, char *out_revision);
+DWORD LoadFPGAPartial(struct device *dev, const char *szFileName);
+struct fvdk_load_user;
+DWORD LoadFPGAUser(struct device *dev, const struct fvdk_load_user *req);
+PUCHAR getFPGAData(struct device *dev, ULONG *size, GENERIC_FPGA_T **ppGen);
+int getFPGAHeader(struct device *dev);
+int initFPGAHeader(struct device *dev);
+int setFPGAHeader(struct device *dev, const void *raw, size_t len);
+void freeFPGAHeader(struct device *dev);
+void copyFPGAHeader(struct device *dev, size_t offset, void *dst, size_t len);
+int copyFPGABufTable(struct device *dev, void __user *dst);
+int getFPGABuf(struct device *dev, ULONG index, SDRAM_BUF_T *buf);
+int mapFPGAHeader(struct device *dev, struct vm_area_struct *vma,
+		  unsigned long pgoff);
+ssize_t readFPGAHeaderMap(struct device *dev, char *buf, loff_t off,
+			  size_t count);
 void freeFpgaData(void);
+int initFvdkStatus(struct device *dev);
+void freeFvdkStatus(struct device *dev);
+int mapFvdkStatus(struct device *dev, struct vm_area_struct *vma);
+void updateFvdkPins(struct device *dev);
+void setFvdkPower(struct device *dev, BOOL fpa, BOOL on);
+void fvdkLoadStart(struct device *dev);
+void fvdkLoadDone(struct device *dev, DWORD res);
+void fvdkLoadStage(struct device *dev, u32 stage);
+void fvdkLoadProgress(struct device *dev, u64 sent, u64 size);
+void fvdkPowerQueued(struct device *dev, u32 seq);
+void fvdkPowerDone(struct device *dev, u32 seq, DWORD res);
+u32 fvdkPowerCompleted(struct device *dev, u32 *res);
+void initFvdkEvents(struct device *dev);
+void fvdkEvent(struct device *dev, u32 events);
+void fvdkFileEvent(struct fvdk_file *ctx, u32 events);
+void addFvdkFile(struct fvdkdata *data, struct fvdk_file *ctx);
+void removeFvdkFile(struct fvdk_file *ctx);
+struct fvdk_events;
+int setFvdkEvents(struct fvdk_file *ctx, const struct fvdk_events *req);
+u32 getFvdkEvents(struct fvdk_file *ctx);
+unsigned int pollFvdkEvents(struct file *file, struct poll_table_struct *wait);
+void watchFvdkPins(struct device *dev);
+void unwatchFvdkPins(struct device *dev);
+void initFvdkBlob(struct device *dev);
+int createFvdkBlob(struct device *dev, size_t size);
+void freeFvdkBlob(struct device *dev);
+int resizeFvdkBlob(struct device *dev, u64 size);
+int mapFvdkBlob(struct device *dev, struct vm_area_struct *vma);
+int getFvdkBlobPages(struct device *dev, unsigned long first,
+		     unsigned long count, struct page **pages);
+int getFvdkBlobExport(struct device *dev, struct fvdk_blob_range *range,
+		      struct page **pages);
+void putFvdkBlobExport(struct fvdk_blob_range *range);
+struct fvdk_blob_export;
+int exportFvdkBlob(struct device *dev, struct fvdk_blob_export *req);
+struct fvdk_blob_info;
+void getFvdkBlobInfo(struct device *dev, struct fvdk_blob_info *info);
+void protectFvdkBlob(struct fvdk_blob *blob);
+BOOL fvdkBlobMapped(struct fvdk_blob *blob, unsigned long first,
+		    unsigned long end);
+struct fvdk_blob_checkpoint;
+int checkpointFvdkBlob(struct device *dev, struct fvdk_blob_checkpoint *req);
+int restoreFvdkBlob(struct device *dev, s32 fd);
+void initFvdkPersist(struct device *dev);
+void saveFvdkPersist(struct fvdk_blob *blob);
+void freeFvdkRegions(struct fvdk_blob *blob);
+unsigned long fvdkRegionsEnd(struct fvdk_blob *blob);
+unsigned int saveFvdkRegions(struct fvdk_blob *blob,
+			     struct fvdk_persist_region *table);
+int restoreFvdkRegions(struct fvdk_blob *blob,
+		       const struct fvdk_persist_region *table, unsigned int n);
+struct fvdk_region;
+int createFvdkRegion(struct device *dev, struct fvdk_region *req);
+int findFvdkRegion(struct device *dev, struct fvdk_region *req);
+int deleteFvdkRegion(struct device *dev, const struct fvdk_region *req);
+int initFvdkLocks(struct device *dev);
+void freeFvdkLocks(struct device *dev);
+int mapFvdkLocks(struct device *dev, struct vm_area_struct *vma);
+int lockFvdk(struct fvdkdata *data, struct fvdk_file *ctx, u32 id,
+	     unsigned int ms);
+int trylockFvdk(struct fvdkdata *data, struct fvdk_file *ctx, u32 id);
+int unlockFvdk(struct fvdkdata *data, struct fvdk_file *ctx, u32 id);
+int lockFvdkShared(struct fvdkdata *data, struct fvdk_file *ctx, u32 id,
+		   unsigned int ms, BOOL try);
+int unlockFvdkShared(struct fvdkdata *data, struct fvdk_file *ctx, u32 id);
+void releaseFvdkLocks(struct fvdk_file *ctx);
+struct fvdk_lock_info;
+int getFvdkLockInfo(struct fvdk_file *ctx, struct fvdk_lock_info *info);
+struct fvdk_lock_wait;
+int waitFvdkLock(struct fvdkdata *data, const struct fvdk_lock_wait *req);
+int wakeFvdkLock(struct fvdk_file *ctx, u32 id);
+struct fvdk_lock_set;
+int acquireFvdkLocks(struct fvdk_file *ctx, struct fvdk_lock_set *set);
+int releaseFvdkLockSet(struct fvdk_file *ctx, struct fvdk_lock_set *set);
+struct fvdk_lock_name;
+int createFvdkLock(struct fvdkdata *data, struct fvdk_lock_name *req);
+int findFvdkLock(struct fvdkdata *data, struct fvdk_lock_name *req);
+struct fvdk_lock_async;
+int queueFvdkLock(struct fvdk_file *ctx, struct fvdk_lock_async *req);
+int cancelFvdkLock(struct fvdk_file *ctx, struct fvdk_lock_async *req);
+long fvdkLockIoctl(struct fvdk_file *ctx, ULONG arg, unsigned int timeout);
+struct fvdk_flash_update;
+int update_spi_flash(struct device *dev, struct fvdk_flash_update *req);
 BOOL GetMainboardVersion(struct device *dev, int *article, int *revision);
 
 #define	FVD_BSP_PIBB  0
@@ -132,7 +345,18 @@ BOOL GetMainboardVersion(struct device *dev, int *article, int *revision);
 #define ROCO_ARTNO 198752	//T198752 ROCO  mainboard article no (Rocky)
 #define EC101_ARTNO 199051	//T199051 ec101  mainboard article no (Evander)
 
-enum locks { LNONE, LDRV, LEXEC, LLEPT };
+#define FPGA_USER_MAX_SIZE	(32 << 20)	// Largest bitstream accepted from user space
+
+// Largest generic + specific header accepted
+#define FPGA_HEADER_MAX_SIZE	(64 << 10)
+#define FPGA_SPEC_MAX_SIZE	(FPGA_HEADER_MAX_SIZE - sizeof(GENERIC_FPGA_T))
+#define FPGA_HDR_SIZE(pGen)	(sizeof(GENERIC_FPGA_T) + (pGen)->spec_size)
+
+// Generic header flags, kept in GENERIC_FPGA_T reserved[0]
+#define FPGA_GEN_FLAGS(pGen)	((pGen)->reserved[0])
+#define FPGA_GEN_PARTIAL	0x00000001	// Partial reconfiguration bitstream
+// Bitstream length in bytes, kept in reserved[1], 0 = up to end of image
+#define FPGA_GEN_SIZE(pGen)	((pGen)->reserved[1])
 
 #endif /* __FVD_INTERNAL_H__ */
 
@@ -0,0 +1,414 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/***********************************************************************
+ *
+ * Description of file:
+ *    FLIR Video Device driver.
+ *    Ioctl extensions shared with user space.
+ *
+ *    The base interface (IOCTL_FVDK_GET_VERSION ... IOCTL_FVDK_LOCK)
+ *    lives in fvdkernel.h in the SDK. The definitions below extend it
+ *    and use a separate ioctl type so the numbers cannot collide.
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#ifndef __FVDK_IOCTL_H__
+#define __FVDK_IOCTL_H__
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include "fpga.h"
+
+#define FVDK_IOC_TYPE		'F'
+
+#define FVDK_FW_NAME_LEN	64
+
+/* Partial reconfiguration, file is loaded from the FLIR/ firmware dir */
+struct fvdk_load_partial {
+	char name[FVDK_FW_NAME_LEN];
+};
+
+#define IOCTL_FVDK_LOAD_PARTIAL \
+	_IOW(FVDK_IOC_TYPE, 0x40, struct fvdk_load_partial)
+
+/*
+ * Full configuration from a bitstream file image (headers included)
+ * held by the caller, without going through the firmware loader.
+ */
+struct fvdk_load_user {
+	__u64 addr;		/* User pointer, used when fd < 0 */
+	__u32 size;		/* Bytes of file image */
+	__s32 fd;		/* Readable fd (memfd) or -1 */
+};
+
+#define IOCTL_FVDK_LOAD_USER \
+	_IOW(FVDK_IOC_TYPE, 0x41, struct fvdk_load_user)
+
+/*
+ * Differential update of the FPGA image in SPI flash. Only erase
+ * sectors whose contents differ are rewritten.
+ */
+struct fvdk_flash_update {
+	__u64 image;		/* User pointer, written from flash offset 0 */
+	__u64 header;		/* User pointer, written HEADER_LENGTH from the end */
+	__u32 image_size;
+	__u32 header_size;	/* 0 leaves the header untouched */
+	/* Returned */
+	__u32 sectors;		/* Erase sectors compared */
+	__u32 sectors_written;
+	__u64 bytes_skipped;
+	__u32 elapsed_ms;
+	__u32 saved_ms;		/* Estimated erase/program time saved */
+};
+
+#define IOCTL_FVDK_FLASH_UPDATE \
+	_IOWR(FVDK_IOC_TYPE, 0x42, struct fvdk_flash_update)
+
+/*
+ * One SDRAM buffer descriptor from the FPGA header, by index.
+ * Fails with -EINVAL past the end of the buffer table.
+ */
+struct fvdk_fpga_buf {
+	__u32 index;
+	__u32 reserved;
+	SDRAM_BUF_T buf;	/* Returned */
+};
+
+#define IOCTL_FVDK_GET_FPGA_BUF_IDX \
+	_IOWR(FVDK_IOC_TYPE, 0x43, struct fvdk_fpga_buf)
+
+/*
+ * Read only mapping of the FPGA headers, at this mmap offset of
+ * /dev/fvdk or through the fpga_header sysfs file. generation is odd
+ * while the driver rewrites the header, readers copy what they need
+ * and retry if generation was odd or changed meanwhile.
+ */
+#define FVDK_MMAP_HEADER_OFFSET	0x40000000
+#define FVDK_HEADER_MAP_SIZE	0x11000
+#define FVDK_HEADER_DATA_OFFSET	64
+
+struct fvdk_header_map {
+	__u32 generation;	/* Incremented twice per header change */
+	__u32 size;		/* Header bytes at data_offset, 0 = none */
+	__u32 data_offset;	/* Generic header, then specific header */
+	__u32 buf_offset;	/* SDRAM_BUF_T table, 0 = none */
+	__u32 buffers;		/* Entries in the table */
+};
+
+/*
+ * Read only status page, one page at this mmap offset of /dev/fvdk.
+ * seq is odd while the driver updates the page, readers copy the
+ * fields and retry if seq was odd or changed meanwhile.
+ * Times are CLOCK_MONOTONIC nanoseconds.
+ */
+#define FVDK_MMAP_STATUS_OFFSET	0x40100000
+
+struct fvdk_status {
+	__u32 seq;
+	__u32 fpga_loaded;
+	__u32 fpga_power;
+	__u32 fpa_power;
+	__u32 ready_pin;	/* Raw READY pin level, 0 = FPGA ready */
+	__u32 loading;		/* Load in progress */
+	__u32 load_generation;	/* Loads since probe, also from flash */
+	__u32 load_result;	/* Result of the last load, 0 = success */
+	__u64 load_start_ns;
+	__u64 load_end_ns;
+	__u64 update_ns;	/* Last change of this page */
+	__u32 done_pin;		/* Raw CONF_DONE pin level */
+	__u32 load_stage;	/* FVDK_STAGE_* of the current load */
+	__u64 load_sent;	/* Bitstream bytes sent so far */
+	__u64 load_size;	/* Bitstream bytes in the current load */
+	__u32 power_seq;	/* Last asynchronous power up queued */
+	__u32 power_done;	/* Last asynchronous power up completed */
+	__u32 power_result;	/* Result of power_done, 0 = success */
+	__u32 reserved;
+};
+
+#define FVDK_STAGE_IDLE		0
+#define FVDK_STAGE_POWER	1	/* Waiting for supplies to settle */
+#define FVDK_STAGE_READ		2	/* Reading the bitstream */
+#define FVDK_STAGE_PROGRAM	3	/* Entering programming mode */
+#define FVDK_STAGE_SEND		4	/* Sending the bitstream */
+#define FVDK_STAGE_CHECK	5	/* Waiting for CONF_DONE */
+
+/*
+ * Events. A file with pending events polls readable (POLLIN), and an
+ * eventfd registered with IOCTL_FVDK_SET_EVENTS is signalled when they
+ * are raised. IOCTL_FVDK_GET_EVENTS returns and clears the pending set.
+ */
+#define FVDK_EV_PINS		0x01	/* READY or CONF_DONE changed */
+#define FVDK_EV_LOAD_DONE	0x02
+#define FVDK_EV_LOAD_FAILED	0x04
+#define FVDK_EV_POWER		0x08	/* FPGA or FPA power changed */
+#define FVDK_EV_SUSPEND		0x10
+#define FVDK_EV_RESUME		0x20
+#define FVDK_EV_POWER_DONE	0x40	/* Asynchronous power up completed */
+#define FVDK_EV_LOCK		0x80	/* Asynchronous lock granted */
+#define FVDK_EV_ALL		0xff
+
+struct fvdk_events {
+	__s32 fd;		/* eventfd, -1 for none */
+	__u32 mask;		/* FVDK_EV_* to raise to this file */
+};
+
+#define IOCTL_FVDK_SET_EVENTS \
+	_IOW(FVDK_IOC_TYPE, 0x44, struct fvdk_events)
+#define IOCTL_FVDK_GET_EVENTS \
+	_IOR(FVDK_IOC_TYPE, 0x45, __u32)
+
+/*
+ * Asynchronous power up. The transition is queued and a sequence
+ * number returned at once, completion is reported by FVDK_EV_POWER_DONE
+ * and power_done/power_result in the status page, or waited for with
+ * IOCTL_FVDK_POWER_WAIT.
+ */
+#define FVDK_POWER_RESTART	0x1	/* Restart the FPGA, and load it on
+					 * boards without SPI flash */
+
+struct fvdk_power_async {
+	__u32 flags;		/* FVDK_POWER_* */
+	__u32 seq;		/* Returned */
+};
+
+#define IOCTL_FVDK_POWER_UP_ASYNC \
+	_IOWR(FVDK_IOC_TYPE, 0x46, struct fvdk_power_async)
+
+struct fvdk_power_wait {
+	__u32 seq;
+	__u32 timeout_ms;	/* 0 waits forever */
+	__u32 result;		/* Returned, result of the latest completed power up */
+};
+
+#define IOCTL_FVDK_POWER_WAIT \
+	_IOWR(FVDK_IOC_TYPE, 0x47, struct fvdk_power_wait)
+
+/*
+ * Export a region of the blob (IOCTL_FVDK_CREATE_BLOB) as a dma-buf.
+ * Offset and size must be page aligned. CPU access through the dma-buf
+ * mmap should be bracketed with DMA_BUF_IOCTL_SYNC.
+ */
+struct fvdk_blob_export {
+	__u64 offset;
+	__u64 size;
+	__u32 flags;		/* O_RDWR, O_RDONLY, O_CLOEXEC */
+	__s32 fd;		/* Returned */
+};
+
+#define IOCTL_FVDK_BLOB_EXPORT \
+	_IOWR(FVDK_IOC_TYPE, 0x48, struct fvdk_blob_export)
+
+/*
+ * Blob size and backing. Pages are allocated one at a time on first
+ * use and mapped page by page.
+ */
+struct fvdk_blob_info {
+	__u64 size;
+	__u32 flags;		/* FVDK_BLOB_* */
+	__u32 pages;		/* Pages allocated so far */
+};
+
+#define FVDK_BLOB_PERSISTENT	0x2	/* Kept in reserved memory */
+#define FVDK_BLOB_RESTORED	0x4	/* Contents restored at probe */
+
+#define IOCTL_FVDK_BLOB_INFO \
+	_IOR(FVDK_IOC_TYPE, 0x49, struct fvdk_blob_info)
+
+/*
+ * Named regions of the blob. Create returns the offset to pass to
+ * mmap() and the size rounded up to whole pages. The alignment is a
+ * power of two, 0 for page alignment. A new region reads as zeroes.
+ */
+#define FVDK_REGION_NAME_LEN	32
+
+struct fvdk_region {
+	char name[FVDK_REGION_NAME_LEN];	/* NUL terminated */
+	__u64 offset;		/* Returned */
+	__u64 size;
+	__u64 align;
+};
+
+#define IOCTL_FVDK_REGION_CREATE \
+	_IOWR(FVDK_IOC_TYPE, 0x4a, struct fvdk_region)
+#define IOCTL_FVDK_REGION_LOOKUP \
+	_IOWR(FVDK_IOC_TYPE, 0x4b, struct fvdk_region)
+/* Deleting a region fails with EBUSY while it is mapped */
+#define IOCTL_FVDK_REGION_DELETE \
+	_IOW(FVDK_IOC_TYPE, 0x4c, struct fvdk_region)
+
+/*
+ * Resize the blob to a new size in bytes. Existing mappings stay
+ * valid, pages added by growing appear on fault. Shrinking fails with
+ * EBUSY while a mapping, dma-buf export or region reaches beyond the
+ * new size.
+ */
+#define IOCTL_FVDK_BLOB_RESIZE \
+	_IOW(FVDK_IOC_TYPE, 0x4d, __u64)
+
+/*
+ * Write the blob to a file opened for writing: a header page, then
+ * the blob pages in order. Only pages written through user mappings
+ * since the last checkpoint or restore are written, unless
+ * FVDK_CHECKPOINT_FULL is set. Use FULL for a new file and after
+ * device writes to exported dma-bufs.
+ */
+#define FVDK_CHECKPOINT_FULL	0x1
+
+struct fvdk_blob_checkpoint {
+	__s32 fd;
+	__u32 flags;		/* FVDK_CHECKPOINT_* */
+	__u64 pages;		/* Returned, pages written */
+};
+
+#define IOCTL_FVDK_BLOB_CHECKPOINT \
+	_IOWR(FVDK_IOC_TYPE, 0x4e, struct fvdk_blob_checkpoint)
+
+/*
+ * Load the blob from a checkpoint file descriptor, creating the blob
+ * with the size of the checkpoint if it does not exist yet.
+ */
+#define IOCTL_FVDK_BLOB_RESTORE \
+	_IOW(FVDK_IOC_TYPE, 0x4f, __s32)
+
+/*
+ * Lock words, one __u32 per lock indexed by lock id (LDRV 1, LEXEC 2,
+ * LLEPT 3, then named locks), in a page mapped shared at this mmap
+ * offset. The words
+ * are shared with IOCTL_FVDK_LOCK. Take a lock with
+ *
+ *	if (cmpxchg(&w[id], FVDK_LOCK_FREE, FVDK_LOCK_HELD) != FVDK_LOCK_FREE)
+ *		ioctl(fd, IOCTL_FVDK_LOCK_WAIT, &(struct fvdk_lock_wait){ id });
+ *
+ * and release it with
+ *
+ *	if (xchg(&w[id], FVDK_LOCK_FREE) == FVDK_LOCK_CONTENDED)
+ *		ioctl(fd, IOCTL_FVDK_LOCK_WAKE, &id);
+ *
+ * IOCTL_FVDK_LOCK_WAIT returns with the lock taken, or fails with
+ * ETIME or EINTR. A word granted through IOCTL_FVDK_LOCK_ASYNC is
+ * released the same way, on the file it was granted to.
+ */
+#define FVDK_MMAP_LOCK_OFFSET	0x40200000
+
+#define FVDK_LOCK_NAME_LEN	32
+
+#define FVDK_LOCK_FREE		0
+#define FVDK_LOCK_HELD		1
+#define FVDK_LOCK_CONTENDED	2	/* Held, release must wake waiters */
+
+struct fvdk_lock_wait {
+	__u32 id;
+	__u32 timeout_ms;	/* 0 waits forever */
+};
+
+#define IOCTL_FVDK_LOCK_WAIT \
+	_IOW(FVDK_IOC_TYPE, 0x50, struct fvdk_lock_wait)
+#define IOCTL_FVDK_LOCK_WAKE \
+	_IOW(FVDK_IOC_TYPE, 0x51, __u32)
+
+/*
+ * Lock state. A lock taken with IOCTL_FVDK_LOCK is released when the
+ * file it was taken on is closed, also when its process dies. If the
+ * owning thread is still alive, it keeps the lock until it releases
+ * it. Acquisitions of a lock released after its owner exited are
+ * counted in dead_handoffs.
+ * The statistics count acquisitions through the driver, not those on
+ * the user space fast path. contended counts acquisitions that found
+ * the lock held, wait_ns their total wait.
+ */
+struct fvdk_lock_info {
+	__u32 id;
+	__u32 word;		/* FVDK_LOCK_* */
+	__s32 owner_pid;	/* 0 if free or taken from user space */
+	__u32 orphaned;		/* Released from a dead owner, not yet retaken */
+	__u32 dead_handoffs;
+	__u32 async_state;	/* FVDK_ASYNC_* of the calling file */
+	__u32 readers;		/* Shared holders */
+	__u32 reserved;
+	__u64 acquisitions;
+	__u64 contended;
+	__u64 wait_ns;
+	__u64 max_wait_ns;
+	char name[FVDK_LOCK_NAME_LEN];
+};
+
+#define IOCTL_FVDK_LOCK_INFO \
+	_IOWR(FVDK_IOC_TYPE, 0x52, struct fvdk_lock_info)
+
+/*
+ * Take or release several locks in one call. The locks are taken in
+ * ascending id order whatever the order in ids, so callers never
+ * deadlock on each other, and either all of them are taken or none.
+ * timeout_ms bounds the whole call, 0 waits forever. With
+ * FVDK_LOCK_TRY nothing waits, and EBUSY is returned if any lock is
+ * held. Released in descending id order.
+ *
+ * FVDK_LOCK_SHARED takes the locks shared with other readers, for
+ * example LDRV by processes that only read driver state. Readers hold
+ * the word together, and a set taken shared is released shared.
+ */
+#define FVDK_LOCK_SET_MAX	8
+
+#define FVDK_LOCK_TRY		0x1
+#define FVDK_LOCK_SHARED	0x2
+
+struct fvdk_lock_set {
+	__u32 count;		/* Used entries in ids */
+	__u32 flags;		/* FVDK_LOCK_* */
+	__u32 timeout_ms;
+	__u32 reserved;
+	__u32 ids[FVDK_LOCK_SET_MAX];
+};
+
+#define IOCTL_FVDK_LOCK_ACQUIRE \
+	_IOW(FVDK_IOC_TYPE, 0x53, struct fvdk_lock_set)
+#define IOCTL_FVDK_LOCK_RELEASE \
+	_IOW(FVDK_IOC_TYPE, 0x54, struct fvdk_lock_set)
+
+/*
+ * Asynchronous lock requests. IOCTL_FVDK_LOCK_ASYNC queues a request
+ * for the file and returns at once. Requests are granted in the order
+ * they were queued, and each grant raises FVDK_EV_LOCK to the file.
+ * A granted lock is held by the file, released as usual or when the
+ * file is closed. async_state in IOCTL_FVDK_LOCK_INFO tells whether a
+ * request is still queued or granted.
+ *
+ * IOCTL_FVDK_LOCK_CANCEL drops a queued request. state returns
+ * FVDK_ASYNC_GRANTED if the lock was granted before the cancel, the
+ * file then holds the lock and must release it.
+ */
+#define FVDK_ASYNC_NONE		0
+#define FVDK_ASYNC_QUEUED	1
+#define FVDK_ASYNC_GRANTED	2
+
+struct fvdk_lock_async {
+	__u32 id;
+	__u32 state;		/* Returned, FVDK_ASYNC_* */
+};
+
+#define IOCTL_FVDK_LOCK_ASYNC \
+	_IOWR(FVDK_IOC_TYPE, 0x55, struct fvdk_lock_async)
+#define IOCTL_FVDK_LOCK_CANCEL \
+	_IOWR(FVDK_IOC_TYPE, 0x56, struct fvdk_lock_async)
+
+/*
+ * Named locks, for users beyond the fixed locks. IOCTL_FVDK_LOCK_CREATE
+ * creates a lock and returns its id, failing with EEXIST if the name
+ * is taken and ENOSPC beyond the max_locks module parameter.
+ * IOCTL_FVDK_LOCK_LOOKUP returns the id of a lock by name, the fixed
+ * ones are named "ldrv", "lexec" and "llept". Named locks are used by
+ * id like the fixed ones, and last until the driver is removed.
+ */
+struct fvdk_lock_name {
+	char name[FVDK_LOCK_NAME_LEN];	/* NUL terminated */
+	__u32 id;		/* Returned */
+	__u32 reserved;
+};
+
+#define IOCTL_FVDK_LOCK_CREATE \
+	_IOWR(FVDK_IOC_TYPE, 0x57, struct fvdk_lock_name)
+#define IOCTL_FVDK_LOCK_LOOKUP \
+	_IOWR(FVDK_IOC_TYPE, 0x58, struct fvdk_lock_name)
+
+#endif /* __FVDK_IOCTL_H__ */
@@ -0,0 +1,1463 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ *    FLIR Video Device driver.
+ *    Driver locks (LDRV, LEXEC, LLEPT and named locks)
+ *
+ *    Each lock is a word in the lock page, mapped read/write at
+ *    FVDK_MMAP_LOCK_OFFSET. User space takes and releases a free lock
+ *    with atomic operations on the word, and only enters the driver
+ *    to wait for a held lock or to wake waiters (see fvdk_ioctl.h).
+ *    IOCTL_FVDK_LOCK and the driver itself use the same words, so all
+ *    paths exclude each other.
+ *
+ *    Locks taken through the driver are also held as an rt_mutex, so
+ *    the owner is known and is priority boosted by waiters. A task that
+ *    has to wait has a proxy thread take the rt_mutex for it, and lends
+ *    the proxy its priority, so waits with a timeout boost as well on
+ *    every kernel. The rt_mutex stays held across the return to user
+ *    space, lockdep is told it is released meanwhile. The owner file
+ *    releases its locks when it is closed. If it is closed after the
+ *    owning task has exited, a proxy holding the rt_mutex for it lets
+ *    go. One the owner took itself can never be unlocked; it is marked
+ *    dead and replaced by a new one, and the proxies waiting on it are
+ *    kicked off to wait on the new one. A lock whose owner is still
+ *    alive stays held, and the owner releases it through any file.
+ *
+ *    Asynchronous requests queue per lock, and are granted in order
+ *    to their files whenever the word is released through the driver.
+ *    Queued requests keep the word contended, so user space releases
+ *    enter the driver too. Like user space holders, granted files are
+ *    not boosted.
+ *
+ *    A lock can also be taken shared. The first reader takes the word
+ *    for all readers and the last one releases it, so exclusive holders
+ *    from user space and the driver alike wait for the readers. Readers
+ *    only join without the rt_mutex while no writer waits on it.
+ *
+ *    Named locks take the ids after the fixed ones, up to max_locks.
+ *    A lock exists once its rtm is set, and is never deleted, so ids
+ *    stay valid without a reference.
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "flir_kernel_os.h"
+#include "fpga.h"
+#include "fvdk_internal.h"
+#include "fvdk_ioctl.h"
+#include <linux/platform_device.h>
+#include <linux/version.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/io.h>
+#include <linux/sched.h>
+#include <linux/sched/task.h>
+#include <linux/sched/signal.h>
+#include <linux/wait.h>
+#include <linux/rtmutex.h>
+#include <linux/lockdep.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/kref.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+
+static unsigned int max_locks = 64;
+module_param(max_locks, uint, 0444);
+MODULE_PARM_DESC(max_locks, "Most locks, fixed and named");
+
+static const char * const fixedNames[FVDK_LOCKS] = {
+	[LDRV] = "ldrv",
+	[LEXEC] = "lexec",
+	[LLEPT] = "llept",
+};
+
+struct fvdk_rtm {
+	struct rt_mutex mutex;
+	struct kref ref;		// Lock, waiting proxies and holder
+	struct task_struct *task;	// Holder unless a proxy, referenced
+	struct list_head waiters;	// Waiting proxies, under lock spin
+	BOOL dead;			// Replaced, held by an exited task
+};
+
+/*
+ * A task that has to wait for an rt_mutex has a proxy take it. The
+ * proxy is a kernel thread holding the gate, which the task waits on,
+ * so the proxy waits at the priority of the task and boosts the owner.
+ * Once the proxy has the rt_mutex, it waits on the hold mutex held by
+ * the task until the lock is released, so later waiters boost the
+ * task. Unlike the task, the proxy can be woken out of its rt_mutex
+ * wait with a signal of its own, on a timeout, when the task gives up
+ * and when the rt_mutex is replaced.
+ */
+#define PROXY_SIGNAL	SIGINT
+
+// Proxy job state, under the lock spin
+enum proxy_state {
+	PROXY_WAIT,	// Waiting for the rt_mutex
+	PROXY_TAKEN,	// Holding the rt_mutex for the task
+	PROXY_FAILED,	// Timed out or the task gave up
+};
+
+struct fvdk_proxy {
+	struct list_head list;		// In fvdkdata proxies
+	struct list_head idle;		// In fvdkdata idleProxies
+	struct list_head waiter;	// In fvdk_rtm waiters
+	struct fvdkdata *data;
+	struct task_struct *thread;
+	struct completion ready;	// Thread holds the gate
+	struct rt_mutex gate;		// Held by the thread, waited on by the task
+	struct rt_mutex hold;		// Held by the task, waited on by the thread
+	struct hrtimer timer;		// Ends the wait on a timeout
+	BOOL retired;			// hold is left held by a dead task
+	// Job, NULL lock while idle
+	struct fvdk_lock *lock;
+	struct task_struct *task;	// Referenced once taken
+	unsigned int ms;		// Timeout, 0 waits forever
+	struct fvdk_rtm *rtm;		// Taken for the task
+	enum proxy_state state;
+	int ret;			// Of PROXY_FAILED
+	BOOL expired;			// Timer fired
+	BOOL cancel;			// Task gave up
+	BOOL gone;			// Task done with the gate
+};
+
+// rt_mutex of a lock held by a task, see rtLock()
+struct rtm_hold {
+	struct fvdk_rtm *rtm;
+	struct fvdk_proxy *proxy;	// Holds rtm for the task, or NULL
+};
+
+// Asynchronous request, in fvdk_lock async
+struct lock_request {
+	struct list_head list;
+	struct fvdk_file *file;
+	u64 queued;		// ktime_get_ns()
+	BOOL busy;		// Lock was held or had requests when queued
+};
+
+// Shared holder, in fvdk_lock shared
+struct shared_hold {
+	struct list_head list;
+	struct fvdk_file *file;
+	struct task_struct *task;	// Only compared, not referenced
+};
+
+static atomic_t *lockWord(struct fvdk_lock *lock)
+{
+	return (atomic_t *)lock->word;
+}
+
+static struct fvdk_rtm *allocRtm(void)
+{
+	struct fvdk_rtm *rtm = kzalloc(sizeof(*rtm), GFP_KERNEL);
+
+	if (rtm) {
+		rt_mutex_init(&rtm->mutex);
+		kref_init(&rtm->ref);
+		INIT_LIST_HEAD(&rtm->waiters);
+	}
+	return rtm;
+}
+
+static void freeRtm(struct kref *ref)
+{
+	struct fvdk_rtm *rtm = container_of(ref, struct fvdk_rtm, ref);
+
+	if (rtm->task)
+		put_task_struct(rtm->task);
+	// A dead rt_mutex is never unlocked, and is leaked rather than
+	// freed while held
+	if (!rtm->dead)
+		kfree(rtm);
+}
+
+// Create a lock at a free id, call with muLocks held
+static int createLock(struct fvdkdata *data, u32 id, const char *name)
+{
+	struct fvdk_lock *lock = &data->locks[id];
+	struct fvdk_rtm *rtm = allocRtm();
+
+	if (!rtm)
+		return -ENOMEM;
+	strscpy(lock->name, name, sizeof(lock->name));
+	// Publishes the lock to getLock()
+	smp_store_release(&lock->rtm, rtm);
+	return 0;
+}
+
+int initFvdkLocks(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_lock *lock;
+	u32 i;
+	int ret;
+
+	BUILD_BUG_ON(sizeof(lock->name) != FVDK_LOCK_NAME_LEN);
+
+	mutex_init(&data->muLocks);
+	INIT_LIST_HEAD(&data->proxies);
+	INIT_LIST_HEAD(&data->idleProxies);
+	spin_lock_init(&data->proxyLock);
+	data->nLocks = clamp_t(u32, max_locks, FVDK_LOCKS,
+			       PAGE_SIZE / sizeof(__u32));
+	data->locks = kcalloc(data->nLocks, sizeof(*data->locks), GFP_KERNEL);
+	data->lockPage = (__u32 *)get_zeroed_page(GFP_KERNEL);
+	if (!data->locks || !data->lockPage) {
+		freeFvdkLocks(dev);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < data->nLocks; i++) {
+		lock = &data->locks[i];
+		lock->word = &data->lockPage[i];
+		init_waitqueue_head(&lock->wait);
+		spin_lock_init(&lock->spin);
+		INIT_LIST_HEAD(&lock->async);
+		INIT_LIST_HEAD(&lock->shared);
+	}
+
+	for (i = LNONE + 1; i < FVDK_LOCKS; i++) {
+		ret = createLock(data, i, fixedNames[i]);
+		if (ret) {
+			freeFvdkLocks(dev);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+void freeFvdkLocks(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_proxy *p, *next;
+	u32 i;
+
+	// All files are closed, proxies are idle or retired
+	list_for_each_entry_safe(p, next, &data->proxies, list) {
+		kthread_stop(p->thread);
+		// A retired hold mutex stays held by a dead task, and is leaked
+		if (!p->retired)
+			kfree(p);
+	}
+	INIT_LIST_HEAD(&data->proxies);
+	INIT_LIST_HEAD(&data->idleProxies);
+
+	for (i = 0; data->locks && i < data->nLocks; i++) {
+		if (data->locks[i].rtm)
+			kref_put(&data->locks[i].rtm->ref, freeRtm);
+	}
+	kfree(data->locks);
+	data->locks = NULL;
+	data->nLocks = 0;
+	free_page((unsigned long)data->lockPage);
+	data->lockPage = NULL;
+}
+
+/**
+ * Map the lock page read/write
+ *
+ * @return 0 on success, <0 on error
+ */
+int mapFvdkLocks(struct device *dev, struct vm_area_struct *vma)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	if (vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	// Private copies of the words would lock nothing
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	return remap_pfn_range(vma, vma->vm_start,
+			       virt_to_phys(data->lockPage) >> PAGE_SHIFT,
+			       PAGE_SIZE, vma->vm_page_prot);
+}
+
+// Take a held lock, marking it contended so its holder wakes waiters
+static BOOL lockTaken(struct fvdk_lock *lock)
+{
+	return atomic_xchg(lockWord(lock), FVDK_LOCK_CONTENDED) == FVDK_LOCK_FREE;
+}
+
+static struct fvdk_lock *getLock(struct fvdkdata *data, u32 id)
+{
+	struct fvdk_lock *lock;
+
+	if (id == LNONE || id >= data->nLocks)
+		return NULL;
+	lock = &data->locks[id];
+	return smp_load_acquire(&lock->rtm) ? lock : NULL;
+}
+
+// Count an acquisition, call with spin held
+static void countLock(struct fvdk_lock *lock, u64 start, BOOL busy)
+{
+	u64 wait = ktime_get_ns() - start;
+
+	lock->acquisitions++;
+	if (busy)
+		lock->contended++;
+	lock->waitNs += wait;
+	lock->maxWaitNs = max(lock->maxWaitNs, wait);
+}
+
+// Snapshot for the statistics, whether an acquisition may have to wait
+static BOOL lockBusy(struct fvdk_lock *lock)
+{
+	return atomic_read(lockWord(lock)) != FVDK_LOCK_FREE;
+}
+
+// Jiffies left until deadline, at least 1. 0 waits forever.
+static long timeLeft(unsigned long deadline, unsigned int ms)
+{
+	if (!ms)
+		return 0;
+	return max_t(long, (long)(deadline - jiffies), 1);
+}
+
+// Take the word, call with the rt_mutex held
+static int wordLock(struct fvdk_lock *lock, long timeout)
+{
+	long ret;
+
+	if (atomic_cmpxchg(lockWord(lock), FVDK_LOCK_FREE, FVDK_LOCK_HELD) ==
+	    FVDK_LOCK_FREE)
+		return 0;
+
+	if (timeout) {
+		ret = wait_event_interruptible_timeout(lock->wait, lockTaken(lock),
+						       timeout);
+		if (ret == 0)
+			return -ETIME;
+	} else {
+		ret = wait_event_interruptible(lock->wait, lockTaken(lock));
+	}
+	return ret < 0 ? -EINTR : 0;
+}
+
+// Taken by a file through an asynchronous request, call with spin held
+static BOOL asyncHeld(struct fvdk_lock *lock, struct fvdk_file *ctx)
+{
+	return lock->file == ctx && !lock->held && !lock->owner;
+}
+
+// FVDK_ASYNC_* of a file for a lock, call with spin held
+static u32 asyncState(struct fvdk_lock *lock, struct fvdk_file *ctx)
+{
+	struct lock_request *req;
+
+	if (asyncHeld(lock, ctx))
+		return FVDK_ASYNC_GRANTED;
+	list_for_each_entry(req, &lock->async, list) {
+		if (req->file == ctx)
+			return FVDK_ASYNC_QUEUED;
+	}
+	return FVDK_ASYNC_NONE;
+}
+
+/*
+ * Grant the word to the oldest asynchronous request if it is free.
+ * If it is held it is left contended, and its release grants it.
+ */
+static void grantAsync(struct fvdk_lock *lock)
+{
+	struct lock_request *req;
+
+	spin_lock(&lock->spin);
+	req = list_first_entry_or_null(&lock->async, struct lock_request, list);
+	if (req && lockTaken(lock)) {
+		list_del(&req->list);
+		lock->file = req->file;
+		countLock(lock, req->queued, req->busy);
+		// Under spin, the file can't be closed meanwhile
+		fvdkFileEvent(req->file, FVDK_EV_LOCK);
+	} else {
+		req = NULL;
+	}
+	spin_unlock(&lock->spin);
+
+	kfree(req);
+}
+
+static void wordUnlock(struct fvdk_lock *lock)
+{
+	if (atomic_xchg(lockWord(lock), FVDK_LOCK_FREE) == FVDK_LOCK_CONTENDED)
+		wake_up_all(&lock->wait);
+	grantAsync(lock);
+}
+
+/*
+ * The rt_mutex of a lock owner, or the hold mutex of its proxy, stays
+ * held across the return to user space. Lockdep would report that, so
+ * it is told the owner released the mutex when it was taken, and took
+ * it again just before the unlock. Lockdep does not check these
+ * mutexes while they are held. The hold mutex is hidden before the
+ * task waits on the gate, as the proxy takes them the other way round.
+ */
+#if defined(CONFIG_DEBUG_LOCK_ALLOC) && \
+	KERNEL_VERSION(4, 16, 0) <= LINUX_VERSION_CODE
+#define FVDK_RTM_LOCKDEP
+#endif
+
+static void rtHandOff(struct rt_mutex *mutex)
+{
+#ifdef FVDK_RTM_LOCKDEP
+#if KERNEL_VERSION(5, 6, 0) <= LINUX_VERSION_CODE
+	mutex_release(&mutex->dep_map, _RET_IP_);
+#else
+	mutex_release(&mutex->dep_map, 1, _RET_IP_);
+#endif
+#endif
+}
+
+static void rtTakeBack(struct rt_mutex *mutex)
+{
+#ifdef FVDK_RTM_LOCKDEP
+	mutex_acquire(&mutex->dep_map, 0, 0, _RET_IP_);
+#endif
+}
+
+/*
+ * Mark an rt_mutex dead once its owner has exited without unlocking
+ * it, and kick the proxies waiting on it. proxyTake() then waits on
+ * the rt_mutex replacing it. Call with lock spin held.
+ */
+static void killRtm(struct fvdk_rtm *rtm)
+{
+	struct fvdk_proxy *p;
+
+	rtm->dead = TRUE;
+	list_for_each_entry(p, &rtm->waiters, waiter)
+		send_sig(PROXY_SIGNAL, p->thread, 1);
+}
+
+static enum hrtimer_restart proxyExpired(struct hrtimer *timer)
+{
+	struct fvdk_proxy *p = container_of(timer, struct fvdk_proxy, timer);
+
+	WRITE_ONCE(p->expired, TRUE);
+	send_sig(PROXY_SIGNAL, p->thread, 1);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Take the current rt_mutex of a lock for the task of the job. The
+ * wait is only ended by the timer, the task giving up, or a kick off
+ * a replaced rt_mutex, after which it waits on the new one.
+ *
+ * @return 0 with the rt_mutex held, -ETIME on timeout, -EINTR if the
+ *         task gave up
+ */
+static int proxyTake(struct fvdk_proxy *p)
+{
+	struct fvdk_lock *lock = p->lock;
+	struct fvdk_rtm *rtm;
+	int ret;
+
+	for (;;) {
+		spin_lock(&lock->spin);
+		rtm = lock->rtm;
+		kref_get(&rtm->ref);
+		list_add_tail(&p->waiter, &rtm->waiters);
+		spin_unlock(&lock->spin);
+
+		ret = rt_mutex_lock_interruptible(&rtm->mutex);
+
+		spin_lock(&lock->spin);
+		list_del(&p->waiter);
+		spin_unlock(&lock->spin);
+
+		// A dead rt_mutex is never unlocked, so only a signal ends it
+		if (ret == 0)
+			break;
+		kref_put(&rtm->ref, freeRtm);
+		// The flags are set before the signal is sent
+		flush_signals(current);
+		if (READ_ONCE(p->cancel))
+			return -EINTR;
+		if (READ_ONCE(p->expired))
+			return -ETIME;
+	}
+	p->rtm = rtm;
+	return 0;
+}
+
+// Wait until the task is done with the gate
+static void proxyWaitGone(struct fvdk_proxy *p)
+{
+	for (;;) {
+		set_current_state(TASK_IDLE);
+		if (READ_ONCE(p->gone))
+			break;
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+}
+
+/*
+ * Run the job of a proxy: take the rt_mutex, tell the task through the
+ * gate, then hold the rt_mutex until the task releases its hold mutex.
+ * Returns with the gate held again, unless the proxy retired.
+ */
+static void proxyJob(struct fvdk_proxy *p)
+{
+	struct fvdk_lock *lock = p->lock;
+	BOOL cancel;
+	int ret;
+
+	if (p->ms)
+		hrtimer_start(&p->timer, ms_to_ktime(p->ms), HRTIMER_MODE_REL);
+	ret = proxyTake(p);
+	hrtimer_cancel(&p->timer);
+
+	spin_lock(&lock->spin);
+	cancel = p->cancel;
+	p->state = ret || cancel ? PROXY_FAILED : PROXY_TAKEN;
+	p->ret = ret;
+	if (p->state == PROXY_TAKEN)
+		get_task_struct(p->task);
+	spin_unlock(&lock->spin);
+	// Only releaseFvdkLocks() sends signals from here on
+	flush_signals(current);
+
+	if (cancel) {
+		// The task left the gate, it is still held
+		if (ret == 0) {
+			rt_mutex_unlock(&p->rtm->mutex);
+			kref_put(&p->rtm->ref, freeRtm);
+		}
+		proxyWaitGone(p);
+		return;
+	}
+
+	rt_mutex_unlock(&p->gate);
+	if (p->state == PROXY_TAKEN) {
+		// Waiters on the rt_mutex boost the task through its hold mutex
+		if (rt_mutex_lock_interruptible(&p->hold) == 0)
+			rt_mutex_unlock(&p->hold);
+		else
+			p->retired = TRUE;
+		rt_mutex_unlock(&p->rtm->mutex);
+		kref_put(&p->rtm->ref, freeRtm);
+		put_task_struct(p->task);
+		flush_signals(current);
+	}
+	proxyWaitGone(p);
+	if (!p->retired)
+		rt_mutex_lock(&p->gate);
+}
+
+static int proxyThread(void *arg)
+{
+	struct fvdk_proxy *p = arg;
+	struct fvdkdata *data = p->data;
+
+	allow_signal(PROXY_SIGNAL);
+	rt_mutex_lock(&p->gate);
+	complete(&p->ready);
+
+	for (;;) {
+		set_current_state(TASK_IDLE);
+		if (kthread_should_stop())
+			break;
+		if (p->retired || !smp_load_acquire(&p->lock)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+
+		proxyJob(p);
+		spin_lock(&data->proxyLock);
+		p->lock = NULL;
+		if (!p->retired)
+			list_add(&p->idle, &data->idleProxies);
+		spin_unlock(&data->proxyLock);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	if (!p->retired)
+		rt_mutex_unlock(&p->gate);
+	return 0;
+}
+
+// Get an idle proxy, starting a new one if there is none
+static struct fvdk_proxy *getProxy(struct fvdkdata *data)
+{
+	struct task_struct *thread;
+	struct fvdk_proxy *p;
+
+	spin_lock(&data->proxyLock);
+	p = list_first_entry_or_null(&data->idleProxies, struct fvdk_proxy,
+				     idle);
+	if (p)
+		list_del(&p->idle);
+	spin_unlock(&data->proxyLock);
+	if (p)
+		return p;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return ERR_PTR(-ENOMEM);
+	p->data = data;
+	rt_mutex_init(&p->gate);
+	rt_mutex_init(&p->hold);
+	init_completion(&p->ready);
+#if KERNEL_VERSION(6, 13, 0) <= LINUX_VERSION_CODE
+	hrtimer_setup(&p->timer, proxyExpired, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&p->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	p->timer.function = proxyExpired;
+#endif
+
+	thread = kthread_create(proxyThread, p, "fvdk_lock");
+	if (IS_ERR(thread)) {
+		kfree(p);
+		return ERR_CAST(thread);
+	}
+	p->thread = thread;
+	wake_up_process(thread);
+	wait_for_completion(&p->ready);
+
+	spin_lock(&data->proxyLock);
+	list_add(&p->list, &data->proxies);
+	spin_unlock(&data->proxyLock);
+	return p;
+}
+
+// Take the current rt_mutex of a lock if it is free
+static BOOL rtTrylock(struct fvdk_lock *lock, struct rtm_hold *rh)
+{
+	struct fvdk_rtm *rtm;
+
+	spin_lock(&lock->spin);
+	rtm = lock->rtm;
+	kref_get(&rtm->ref);
+	spin_unlock(&lock->spin);
+
+	if (!rt_mutex_trylock(&rtm->mutex)) {
+		kref_put(&rtm->ref, freeRtm);
+		return FALSE;
+	}
+	rtHandOff(&rtm->mutex);
+	get_task_struct(current);
+	rtm->task = current;
+	rh->rtm = rtm;
+	rh->proxy = NULL;
+	return TRUE;
+}
+
+/*
+ * Take the current rt_mutex of a lock, through a proxy unless it is
+ * free. The task waits on the gate of the proxy throughout, so it
+ * boosts the owner whether or not the wait has a timeout.
+ *
+ * @param ms timeout in ms, 0 waits forever
+ *
+ * @return 0 on success, -ETIME on timeout, -EINTR if interrupted
+ */
+static int rtLock(struct fvdkdata *data, struct fvdk_lock *lock,
+		  unsigned int ms, struct rtm_hold *rh)
+{
+	struct fvdk_proxy *p;
+	int ret;
+
+	if (rtTrylock(lock, rh))
+		return 0;
+
+	p = getProxy(data);
+	if (IS_ERR(p))
+		return PTR_ERR(p);
+
+	// Held until the lock is released, for the proxy to wait on
+	rt_mutex_lock(&p->hold);
+	rtHandOff(&p->hold);
+
+	p->task = current;
+	p->ms = ms;
+	p->state = PROXY_WAIT;
+	p->expired = FALSE;
+	p->cancel = FALSE;
+	p->gone = FALSE;
+	smp_store_release(&p->lock, lock);
+	wake_up_process(p->thread);
+
+	ret = rt_mutex_lock_interruptible(&p->gate);
+	spin_lock(&lock->spin);
+	if (ret && p->state == PROXY_WAIT) {
+		p->cancel = TRUE;
+		send_sig(PROXY_SIGNAL, p->thread, 1);
+	}
+	spin_unlock(&lock->spin);
+
+	if (!p->cancel) {
+		// If interrupted after the proxy was done, it lets go at once
+		if (ret)
+			rt_mutex_lock(&p->gate);
+		rt_mutex_unlock(&p->gate);
+		ret = p->state == PROXY_TAKEN ? 0 : p->ret;
+	}
+
+	if (ret) {
+		rtTakeBack(&p->hold);
+		rt_mutex_unlock(&p->hold);
+	} else {
+		rh->rtm = p->rtm;
+		rh->proxy = p;
+	}
+	// The proxy may be reused from here on
+	WRITE_ONCE(p->gone, TRUE);
+	if (ret)
+		wake_up_process(p->thread);
+	return ret;
+}
+
+static void rtUnlock(struct fvdk_lock *lock, struct rtm_hold *rh)
+{
+	struct fvdk_rtm *rtm = rh->rtm;
+	struct task_struct *task;
+
+	if (rh->proxy) {
+		// The proxy releases the rt_mutex once it has the hold mutex
+		rtTakeBack(&rh->proxy->hold);
+		rt_mutex_unlock(&rh->proxy->hold);
+		return;
+	}
+
+	task = rtm->task;
+	rtTakeBack(&rtm->mutex);
+	rtm->task = NULL;
+	rt_mutex_unlock(&rtm->mutex);
+	put_task_struct(task);
+	kref_put(&rtm->ref, freeRtm);
+}
+
+// Record the owner of a lock just taken
+static void lockOwned(struct fvdkdata *data, struct fvdk_lock *lock, u32 id,
+		      struct rtm_hold *rh, struct fvdk_file *ctx, u64 start,
+		      BOOL busy)
+{
+	BOOL handoff;
+
+	spin_lock(&lock->spin);
+	countLock(lock, start, busy);
+	lock->held = rh->rtm;
+	lock->proxy = rh->proxy;
+	lock->owner = current;
+	lock->file = ctx;
+	handoff = lock->orphaned;
+	lock->orphaned = FALSE;
+	if (handoff)
+		lock->handoffs++;
+	spin_unlock(&lock->spin);
+
+	if (handoff)
+		dev_warn(data->dev, "Lock %u handed to pid %d after a dead owner\n",
+			 id, task_pid_nr(current));
+}
+
+/**
+ * Take a lock, waiting while it is held. The caller becomes its
+ * owner, and waiters with higher priority boost the caller until it
+ * releases the lock with unlockFvdk().
+ *
+ * @param ctx file the lock is taken for, released when it is closed.
+ *            NULL for the driver's own use.
+ * @param ms timeout in ms, 0 waits forever
+ *
+ * @return 0 on success, -ETIME on timeout, -EINTR if interrupted,
+ *         -EINVAL for an unknown lock
+ */
+int lockFvdk(struct fvdkdata *data, struct fvdk_file *ctx, u32 id,
+	     unsigned int ms)
+{
+	struct fvdk_lock *lock = getLock(data, id);
+	unsigned long deadline = jiffies + msecs_to_jiffies(ms);
+	u64 start = ktime_get_ns();
+	struct rtm_hold rh;
+	BOOL busy;
+	int ret;
+
+	if (!lock)
+		return -EINVAL;
+	busy = lockBusy(lock);
+
+	ret = rtLock(data, lock, ms, &rh);
+	if (ret)
+		return ret;
+
+	// A user space holder of the word is not boosted
+	ret = wordLock(lock, timeLeft(deadline, ms));
+	if (ret) {
+		rtUnlock(lock, &rh);
+		return ret;
+	}
+
+	lockOwned(data, lock, id, &rh, ctx, start, busy);
+	return 0;
+}
+
+/**
+ * Take a lock only if it is free, never waiting
+ *
+ * @return 0 on success, -EBUSY if held, -EINVAL for an unknown lock
+ */
+int trylockFvdk(struct fvdkdata *data, struct fvdk_file *ctx, u32 id)
+{
+	struct fvdk_lock *lock = getLock(data, id);
+	u64 start = ktime_get_ns();
+	struct rtm_hold rh;
+
+	if (!lock)
+		return -EINVAL;
+
+	if (!rtTrylock(lock, &rh))
+		return -EBUSY;
+
+	if (atomic_cmpxchg(lockWord(lock), FVDK_LOCK_FREE, FVDK_LOCK_HELD) !=
+	    FVDK_LOCK_FREE) {
+		rtUnlock(lock, &rh);
+		return -EBUSY;
+	}
+
+	lockOwned(data, lock, id, &rh, ctx, start, FALSE);
+	return 0;
+}
+
+/**
+ * Release a lock. A lock taken through the driver can only be
+ * released by its owner, one granted asynchronously only through the
+ * file it was granted to. One taken on the word is released there.
+ *
+ * @return 0 on success, -EPERM if another task or file holds the lock
+ *         or it is held shared
+ */
+int unlockFvdk(struct fvdkdata *data, struct fvdk_file *ctx, u32 id)
+{
+	struct fvdk_lock *lock = getLock(data, id);
+	struct rtm_hold rh;
+
+	if (!lock)
+		return 0;
+
+	spin_lock(&lock->spin);
+	if ((lock->owner && lock->owner != current) ||
+	    (!lock->owner && lock->file != ctx) || lock->readers) {
+		spin_unlock(&lock->spin);
+		return -EPERM;
+	}
+	rh.rtm = lock->held;
+	rh.proxy = lock->proxy;
+	lock->held = NULL;
+	lock->proxy = NULL;
+	lock->owner = NULL;
+	lock->file = NULL;
+	spin_unlock(&lock->spin);
+
+	wordUnlock(lock);
+	if (rh.rtm)
+		rtUnlock(lock, &rh);
+	return 0;
+}
+
+// Join the readers of a lock, call with spin held
+static void joinShared(struct fvdk_lock *lock, struct shared_hold *hold,
+		       u64 start, BOOL busy)
+{
+	list_add_tail(&hold->list, &lock->shared);
+	lock->readers++;
+	countLock(lock, start, busy);
+}
+
+/**
+ * Take a lock shared with other readers. Readers join a lock held
+ * shared at once unless a writer waits for it, otherwise they queue
+ * on the rt_mutex along with writers, so writers are not starved.
+ *
+ * @param ctx file the lock is taken for, released when it is closed
+ * @param ms timeout in ms, 0 waits forever
+ * @param try fail with -EBUSY instead of waiting
+ *
+ * @return 0 on success, -EBUSY if try found the lock held exclusive,
+ *         -ETIME on timeout, -EINTR if interrupted, -EINVAL for an
+ *         unknown lock
+ */
+int lockFvdkShared(struct fvdkdata *data, struct fvdk_file *ctx, u32 id,
+		   unsigned int ms, BOOL try)
+{
+	struct fvdk_lock *lock = getLock(data, id);
+	unsigned long deadline = jiffies + msecs_to_jiffies(ms);
+	u64 start = ktime_get_ns();
+	struct shared_hold *hold;
+	struct rtm_hold rh;
+	BOOL busy;
+	int ret = 0;
+
+	if (!lock)
+		return -EINVAL;
+
+	hold = kmalloc(sizeof(*hold), GFP_KERNEL);
+	if (!hold)
+		return -ENOMEM;
+	hold->file = ctx;
+	hold->task = current;
+
+	spin_lock(&lock->spin);
+	if (lock->readers && !rt_mutex_is_locked(&lock->rtm->mutex) &&
+	    list_empty(&lock->async)) {
+		joinShared(lock, hold, start, FALSE);
+		spin_unlock(&lock->spin);
+		return 0;
+	}
+	// Held exclusive, or a writer or asynchronous request waits
+	busy = lockBusy(lock) || rt_mutex_is_locked(&lock->rtm->mutex);
+	spin_unlock(&lock->spin);
+
+	if (try)
+		ret = rtTrylock(lock, &rh) ? 0 : -EBUSY;
+	else
+		ret = rtLock(data, lock, ms, &rh);
+	if (ret) {
+		kfree(hold);
+		return ret;
+	}
+
+	// Only the rt_mutex holder makes the first reader. With requests
+	// queued it waits for the word instead of joining the readers.
+	spin_lock(&lock->spin);
+	if (lock->readers && list_empty(&lock->async)) {
+		joinShared(lock, hold, start, busy);
+		hold = NULL;
+	}
+	spin_unlock(&lock->spin);
+
+	if (hold) {
+		if (try)
+			ret = atomic_cmpxchg(lockWord(lock), FVDK_LOCK_FREE,
+					     FVDK_LOCK_HELD) == FVDK_LOCK_FREE ?
+			      0 : -EBUSY;
+		else
+			ret = wordLock(lock, timeLeft(deadline, ms));
+
+		if (ret) {
+			kfree(hold);
+		} else {
+			spin_lock(&lock->spin);
+			joinShared(lock, hold, start, busy);
+			spin_unlock(&lock->spin);
+		}
+	}
+
+	rtUnlock(lock, &rh);
+	return ret;
+}
+
+// Shared hold of a file, by task unless NULL
+static struct shared_hold *findShared(struct fvdk_lock *lock,
+				      struct fvdk_file *ctx,
+				      struct task_struct *task)
+{
+	struct shared_hold *hold, *found = NULL;
+
+	spin_lock(&lock->spin);
+	list_for_each_entry(hold, &lock->shared, list) {
+		if (hold->file == ctx && (!task || hold->task == task)) {
+			found = hold;
+			break;
+		}
+	}
+	spin_unlock(&lock->spin);
+	return found;
+}
+
+// Leave the readers of a lock, releasing the word after the last one
+static void leaveShared(struct fvdk_lock *lock, struct shared_hold *hold)
+{
+	BOOL last;
+
+	spin_lock(&lock->spin);
+	list_del(&hold->list);
+	last = --lock->readers == 0;
+	spin_unlock(&lock->spin);
+
+	kfree(hold);
+	if (last)
+		wordUnlock(lock);
+}
+
+/**
+ * Release a lock taken shared by this task on a file
+ *
+ * @return 0 on success, -EPERM if the task does not hold it shared
+ */
+int unlockFvdkShared(struct fvdkdata *data, struct fvdk_file *ctx, u32 id)
+{
+	struct fvdk_lock *lock = getLock(data, id);
+	struct shared_hold *hold;
+
+	if (!lock)
+		return 0;
+
+	hold = findShared(lock, ctx, current);
+	if (!hold)
+		return -EPERM;
+	leaveShared(lock, hold);
+	return 0;
+}
+
+/**
+ * Release the locks a file still holds, when it is closed
+ */
+void releaseFvdkLocks(struct fvdk_file *ctx)
+{
+	struct fvdkdata *data = ctx->data;
+	struct fvdk_lock *lock;
+	struct lock_request *req, *tmp;
+	struct shared_hold *hold;
+	struct fvdk_rtm *rtm, *new;
+	struct task_struct *owner;
+	LIST_HEAD(dropped);
+	pid_t pid;
+	u32 id;
+
+	for (id = LNONE + 1; id < data->nLocks; id++) {
+		lock = getLock(data, id);
+		if (!lock)
+			continue;
+
+		// Requests still queued are never granted
+		spin_lock(&lock->spin);
+		list_for_each_entry_safe(req, tmp, &lock->async, list) {
+			if (req->file == ctx)
+				list_move(&req->list, &dropped);
+		}
+		spin_unlock(&lock->spin);
+
+		while ((hold = findShared(lock, ctx, NULL)))
+			leaveShared(lock, hold);
+
+		if (READ_ONCE(lock->file) != ctx)
+			continue;
+
+		// Closed by the owner, or granted to the file: a normal release
+		if (READ_ONCE(lock->owner) == current || !READ_ONCE(lock->owner)) {
+			unlockFvdk(data, ctx, id);
+			continue;
+		}
+
+		new = allocRtm();
+		if (!new) {
+			dev_err(data->dev, "Lock %u left held by closed file\n", id);
+			continue;
+		}
+
+		spin_lock(&lock->spin);
+		if (lock->file != ctx || !lock->owner) {
+			spin_unlock(&lock->spin);
+			kref_put(&new->ref, freeRtm);
+			continue;
+		}
+		// Referenced by the proxy or the rt_mutex while it holds it
+		owner = lock->proxy ? lock->proxy->task : lock->held->task;
+		if (!(owner->flags & PF_EXITING) && !owner->exit_state) {
+			// Still alive, e.g. the file was shared with a child
+			lock->file = NULL;
+			spin_unlock(&lock->spin);
+			kref_put(&new->ref, freeRtm);
+			continue;
+		}
+		pid = task_pid_nr(owner);
+		rtm = lock->held;
+		if (lock->proxy) {
+			// The proxy lets the rt_mutex go once kicked off the
+			// hold mutex of the owner, and keeps the reference
+			send_sig(PROXY_SIGNAL, lock->proxy->thread, 1);
+			rtm = new;
+		} else {
+			killRtm(lock->rtm);
+			kref_put(&lock->rtm->ref, freeRtm);
+			lock->rtm = new;
+		}
+		lock->held = NULL;
+		lock->proxy = NULL;
+		lock->owner = NULL;
+		lock->file = NULL;
+		lock->orphaned = TRUE;
+		spin_unlock(&lock->spin);
+
+		dev_warn(data->dev, "Lock %u released from dead owner pid %d\n",
+			 id, pid);
+		wordUnlock(lock);
+		kref_put(&rtm->ref, freeRtm);
+	}
+
+	list_for_each_entry_safe(req, tmp, &dropped, list)
+		kfree(req);
+}
+
+/**
+ * IOCTL_FVDK_LOCK_WAIT, the slow path of a user space lock. Waiters
+ * queue on the rt_mutex in priority order, and return holding only
+ * the word.
+ *
+ * @return 0 on success, <0 on error
+ */
+int waitFvdkLock(struct fvdkdata *data, const struct fvdk_lock_wait *req)
+{
+	struct fvdk_lock *lock = getLock(data, req->id);
+	unsigned long deadline = jiffies + msecs_to_jiffies(req->timeout_ms);
+	u64 start = ktime_get_ns();
+	struct rtm_hold rh;
+	int ret;
+
+	if (!lock)
+		return -EINVAL;
+
+	ret = rtLock(data, lock, req->timeout_ms, &rh);
+	if (ret)
+		return ret;
+	ret = wordLock(lock, timeLeft(deadline, req->timeout_ms));
+	if (!ret) {
+		// Only the slow path of user space acquisitions is seen
+		spin_lock(&lock->spin);
+		countLock(lock, start, TRUE);
+		spin_unlock(&lock->spin);
+	}
+	rtUnlock(lock, &rh);
+	return ret;
+}
+
+/**
+ * Wake the waiters of a lock user space released while contended.
+ * Granted words are left contended, so a grantee releasing on the word
+ * always gets here, and the grant is dropped from its file.
+ *
+ * @return 0 on success, -EINVAL for an unknown lock
+ */
+int wakeFvdkLock(struct fvdk_file *ctx, u32 id)
+{
+	struct fvdk_lock *lock = getLock(ctx->data, id);
+
+	if (!lock)
+		return -EINVAL;
+	spin_lock(&lock->spin);
+	if (asyncHeld(lock, ctx))
+		lock->file = NULL;
+	spin_unlock(&lock->spin);
+	wake_up_all(&lock->wait);
+	grantAsync(lock);
+	return 0;
+}
+
+static int cmpId(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Sort the ids of a set, rejecting unknown and repeated locks
+static int sortSet(struct fvdkdata *data, struct fvdk_lock_set *set)
+{
+	u32 i;
+
+	if (set->count == 0 || set->count > FVDK_LOCK_SET_MAX ||
+	    (set->flags & ~(FVDK_LOCK_TRY | FVDK_LOCK_SHARED)))
+		return -EINVAL;
+
+	sort(set->ids, set->count, sizeof(set->ids[0]), cmpId, NULL);
+	for (i = 0; i < set->count; i++) {
+		if (!getLock(data, set->ids[i]))
+			return -EINVAL;
+		if (i && set->ids[i] == set->ids[i - 1])
+			return -EINVAL;
+	}
+	return 0;
+}
+
+// Release one lock of a set in the mode of the set
+static int putSetLock(struct fvdk_file *ctx, struct fvdk_lock_set *set, u32 id)
+{
+	if (set->flags & FVDK_LOCK_SHARED)
+		return unlockFvdkShared(ctx->data, ctx, id);
+	return unlockFvdk(ctx->data, ctx, id);
+}
+
+/**
+ * IOCTL_FVDK_LOCK_ACQUIRE, take all locks of a set in ascending id
+ * order, within one timeout. Taken locks are released on failure.
+ *
+ * @return 0 on success, -EBUSY if FVDK_LOCK_TRY found a lock held,
+ *         -ETIME on timeout, -EINTR if interrupted, -EINVAL for a bad set
+ */
+int acquireFvdkLocks(struct fvdk_file *ctx, struct fvdk_lock_set *set)
+{
+	struct fvdkdata *data = ctx->data;
+	unsigned long deadline = jiffies + msecs_to_jiffies(set->timeout_ms);
+	unsigned int ms = 0;
+	int ret;
+	u32 i;
+
+	ret = sortSet(data, set);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < set->count; i++) {
+		if (set->timeout_ms && !(set->flags & FVDK_LOCK_TRY)) {
+			if (time_after_eq(jiffies, deadline)) {
+				ret = -ETIME;
+				break;
+			}
+			ms = max(jiffies_to_msecs(deadline - jiffies), 1U);
+		}
+
+		if (set->flags & FVDK_LOCK_SHARED)
+			ret = lockFvdkShared(data, ctx, set->ids[i], ms,
+					     set->flags & FVDK_LOCK_TRY);
+		else if (set->flags & FVDK_LOCK_TRY)
+			ret = trylockFvdk(data, ctx, set->ids[i]);
+		else
+			ret = lockFvdk(data, ctx, set->ids[i], ms);
+		if (ret)
+			break;
+	}
+
+	if (ret) {
+		while (i--)
+			putSetLock(ctx, set, set->ids[i]);
+	}
+	return ret;
+}
+
+/**
+ * IOCTL_FVDK_LOCK_RELEASE, release all locks of a set in descending
+ * id order. Locks this task does not own are left alone.
+ *
+ * @return 0 on success, -EPERM if a lock is owned by another task,
+ *         -EINVAL for a bad set
+ */
+int releaseFvdkLockSet(struct fvdk_file *ctx, struct fvdk_lock_set *set)
+{
+	struct fvdkdata *data = ctx->data;
+	int ret, err = 0;
+	u32 i;
+
+	ret = sortSet(data, set);
+	if (ret)
+		return ret;
+
+	for (i = set->count; i--;) {
+		ret = putSetLock(ctx, set, set->ids[i]);
+		if (ret)
+			err = ret;
+	}
+	return err;
+}
+
+/**
+ * Get the owner, dead owner count and statistics of a lock
+ *
+ * @param info id, returns the rest
+ *
+ * @return 0 on success, -EINVAL for an unknown lock
+ */
+int getFvdkLockInfo(struct fvdk_file *ctx, struct fvdk_lock_info *info)
+{
+	struct fvdk_lock *lock = getLock(ctx->data, info->id);
+
+	if (!lock)
+		return -EINVAL;
+
+	spin_lock(&lock->spin);
+	info->word = READ_ONCE(*lock->word);
+	info->owner_pid = lock->owner ? task_tgid_nr(lock->owner) : 0;
+	info->dead_handoffs = lock->handoffs;
+	info->orphaned = lock->orphaned;
+	info->async_state = asyncState(lock, ctx);
+	info->readers = lock->readers;
+	info->acquisitions = lock->acquisitions;
+	info->contended = lock->contended;
+	info->wait_ns = lock->waitNs;
+	info->max_wait_ns = lock->maxWaitNs;
+	spin_unlock(&lock->spin);
+	memcpy(info->name, lock->name, sizeof(info->name));
+	return 0;
+}
+
+/**
+ * IOCTL_FVDK_LOCK_ASYNC, queue a request for a lock and return at once.
+ * FVDK_EV_LOCK is raised to the file when it is granted, which may
+ * happen before this returns.
+ *
+ * @param req id, returns state
+ *
+ * @return 0 on success, -EALREADY if the file already has a request
+ *         for the lock, -EINVAL for an unknown lock
+ */
+int queueFvdkLock(struct fvdk_file *ctx, struct fvdk_lock_async *req)
+{
+	struct fvdk_lock *lock = getLock(ctx->data, req->id);
+	struct lock_request *r;
+
+	if (!lock)
+		return -EINVAL;
+
+	r = kmalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+	r->file = ctx;
+	r->queued = ktime_get_ns();
+
+	spin_lock(&lock->spin);
+	r->busy = lockBusy(lock) || !list_empty(&lock->async);
+	if (asyncState(lock, ctx) != FVDK_ASYNC_NONE) {
+		spin_unlock(&lock->spin);
+		kfree(r);
+		return -EALREADY;
+	}
+	list_add_tail(&r->list, &lock->async);
+	spin_unlock(&lock->spin);
+
+	// Marks the word contended, or grants it if free
+	grantAsync(lock);
+
+	spin_lock(&lock->spin);
+	req->state = asyncState(lock, ctx);
+	spin_unlock(&lock->spin);
+	return 0;
+}
+
+/**
+ * IOCTL_FVDK_LOCK_CANCEL, drop a queued request of the file
+ *
+ * @param req id, returns state. FVDK_ASYNC_GRANTED if the request
+ *            was granted before, and the file holds the lock.
+ *
+ * @return 0 on success, -EINVAL for an unknown lock
+ */
+int cancelFvdkLock(struct fvdk_file *ctx, struct fvdk_lock_async *req)
+{
+	struct fvdk_lock *lock = getLock(ctx->data, req->id);
+	struct lock_request *r, *found = NULL;
+
+	if (!lock)
+		return -EINVAL;
+
+	spin_lock(&lock->spin);
+	list_for_each_entry(r, &lock->async, list) {
+		if (r->file == ctx) {
+			found = r;
+			list_del(&r->list);
+			break;
+		}
+	}
+	req->state = asyncState(lock, ctx);
+	spin_unlock(&lock->spin);
+
+	kfree(found);
+	return 0;
+}
+
+/**
+ * IOCTL_FVDK_LOCK, release the lock in the low 16 bits of arg, then
+ * take the lock in the high 16 bits, waiting up to timeout ms
+ *
+ * @return ERROR_SUCCESS, or <0 on error
+ */
+long fvdkLockIoctl(struct fvdk_file *ctx, ULONG arg, unsigned int timeout)
+{
+	struct fvdkdata *data = ctx->data;
+	u32 lock = arg >> 16;
+	u32 unlock = arg & 0xFFFF;
+	int err;
+
+	err = unlockFvdk(data, ctx, unlock);
+	if (err) {
+		dev_err(data->dev, "Unlock of %u by non-owner\n", unlock);
+		return err;
+	}
+	if (lock == LNONE)
+		return ERROR_SUCCESS;
+
+	err = lockFvdk(data, ctx, lock, timeout);
+	if (err == -EINVAL)
+		return ERROR_INVALID_PARAMETER;
+	if (err)
+		dev_dbg(data->dev, "Lock failed %u %u %d\n", unlock, lock, err);
+	return err;
+}
+
+static BOOL validName(const char *name)
+{
+	size_t len = strnlen(name, FVDK_LOCK_NAME_LEN);
+
+	return len > 0 && len < FVDK_LOCK_NAME_LEN;
+}
+
+// Id of a lock by name, LNONE if none. Names never change once set.
+static u32 findLock(struct fvdkdata *data, const char *name)
+{
+	u32 id;
+
+	for (id = LNONE + 1; id < data->nLocks; id++) {
+		if (getLock(data, id) && !strcmp(data->locks[id].name, name))
+			return id;
+	}
+	return LNONE;
+}
+
+/**
+ * IOCTL_FVDK_LOCK_CREATE, create a named lock at the first free id
+ *
+ * @param req name, returns id
+ *
+ * @return 0 on success, -EEXIST if the name is taken, -ENOSPC if all
+ *         max_locks ids are used, -EINVAL for a bad name
+ */
+int createFvdkLock(struct fvdkdata *data, struct fvdk_lock_name *req)
+{
+	int ret = -ENOSPC;
+	u32 id;
+
+	if (!validName(req->name))
+		return -EINVAL;
+
+	mutex_lock(&data->muLocks);
+	if (findLock(data, req->name) != LNONE) {
+		ret = -EEXIST;
+		goto out;
+	}
+	for (id = FVDK_LOCKS; id < data->nLocks; id++) {
+		if (getLock(data, id))
+			continue;
+		ret = createLock(data, id, req->name);
+		if (!ret)
+			req->id = id;
+		break;
+	}
+out:
+	mutex_unlock(&data->muLocks);
+	return ret;
+}
+
+/**
+ * IOCTL_FVDK_LOCK_LOOKUP, find a fixed or named lock by name
+ *
+ * @param req name, returns id
+ *
+ * @return 0 on success, -ENOENT if there is no such lock
+ */
+int findFvdkLock(struct fvdkdata *data, struct fvdk_lock_name *req)
+{
+	if (!validName(req->name))
+		return -EINVAL;
+
+	req->id = findLock(data, req->name);
+	return req->id == LNONE ? -ENOENT : 0;
+}
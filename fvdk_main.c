@@ -22,11 +22,11 @@
 #include "fpga.h"
 #include "fvdkernel.h"
 #include "fvdk_internal.h"
+#include "fvdk_ioctl.h"
 #include "roco_header.h"
 #include <linux/platform_device.h>
 #include <linux/mm.h>
 #include <linux/version.h>
-#include <linux/vmalloc.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
 
@@ -35,6 +35,7 @@
 // Local prototypes
 static long FVD_IOControl(struct file *file, unsigned int cmd, unsigned long arg);
 static int FVD_Open(struct inode *inode, struct file *file);
+static int FVD_Release(struct inode *inode, struct file *file);
 static int FVD_mmap(struct file *file, struct vm_area_struct *vma);
 static int fvdk_suspend(struct device *dev);
 static int fvdk_resume(struct device *dev);
@@ -49,15 +50,77 @@ static ssize_t suspend_store(struct device *dev,
 
 static int lock_timeout = 3000;
 module_param(lock_timeout, int, 0600);
-MODULE_PARM_DESC(lock_timeout, "Mutex timeout in ms");
+MODULE_PARM_DESC(lock_timeout, "Mutex timeout in ms, 0 waits forever");
+
+static bool fpga_sim;
+module_param(fpga_sim, bool, 0444);
+MODULE_PARM_DESC(fpga_sim, "Use the simulated FPGA instead of the board");
 
 // Code
 
+// Power transitions, recorded in the status page
+static void FvdPowerUp(struct device *dev, BOOL restart)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	data->ops.pBSPFvdPowerUp(dev, restart);
+	setFvdkPower(dev, FALSE, TRUE);
+}
+
+static void FvdPowerDown(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	data->ops.pBSPFvdPowerDown(dev);
+	setFvdkPower(dev, FALSE, FALSE);
+}
+
+static void FvdPowerUpFPA(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	data->ops.pBSPFvdPowerUpFPA(dev);
+	setFvdkPower(dev, TRUE, TRUE);
+}
+
+static void FvdPowerDownFPA(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	data->ops.pBSPFvdPowerDownFPA(dev);
+	setFvdkPower(dev, TRUE, FALSE);
+}
+
+/**
+ * Asynchronous power up, queued by IOCTL_FVDK_POWER_UP_ASYNC.
+ * Requests queued while this runs are completed by the next run.
+ */
+static void FvdPowerWork(struct work_struct *work)
+{
+	struct fvdkdata *data = container_of(work, struct fvdkdata, powerWork);
+	struct device *dev = data->dev;
+	u32 seq = atomic_read(&data->powerSeq);
+	int flags = atomic_xchg(&data->powerFlags, 0);
+	DWORD res = ERROR_SUCCESS;
+
+	fvdkLoadStage(dev, FVDK_STAGE_POWER);
+	FvdPowerUp(dev, (flags & FVDK_POWER_RESTART) != 0);
+	fvdkLoadStage(dev, FVDK_STAGE_IDLE);
+
+	// Same as resume, the FPGA is only loaded by us without SPI flash
+	if ((flags & FVDK_POWER_RESTART) && !data->pDev.spi_flash)
+		res = LoadFPGA(dev, "");
+
+	fvdkPowerDone(dev, seq, res);
+}
+
 static const struct file_operations fvd_fops = {
 	.owner = THIS_MODULE,
 	.unlocked_ioctl = FVD_IOControl,
 	.open = FVD_Open,
+	.release = FVD_Release,
 	.mmap = FVD_mmap,
+	.poll = pollFvdkEvents,
 };
 
 static DEVICE_ATTR_WO(suspend);
@@ -74,6 +137,28 @@ static const struct attribute_group fvdk_sysfs_group = {
 	.attrs = fvdk_sysfs_attrs,
 };
 
+static ssize_t fpga_header_read(struct file *filp, struct kobject *kobj,
+				struct bin_attribute *attr, char *buf,
+				loff_t off, size_t count)
+{
+	return readFPGAHeaderMap(kobj_to_dev(kobj), buf, off, count);
+}
+
+static int fpga_header_mmap(struct file *filp, struct kobject *kobj,
+			    struct bin_attribute *attr,
+			    struct vm_area_struct *vma)
+{
+	return mapFPGAHeader(kobj_to_dev(kobj), vma, vma->vm_pgoff);
+}
+
+// Same layout as the FVDK_MMAP_HEADER_OFFSET mapping
+static struct bin_attribute bin_attr_fpga_header = {
+	.attr = { .name = "fpga_header", .mode = 0444 },
+	.size = FVDK_HEADER_MAP_SIZE,
+	.read = fpga_header_read,
+	.mmap = fpga_header_mmap,
+};
+
 static ssize_t resume_store(struct device *dev,
 			    struct device_attribute *attr,
 			    const char *buf, size_t count)
@@ -102,17 +187,17 @@ static ssize_t suspend_store(struct device *dev,
 
 static int FVD_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	int size;
-	struct fvdkdata *data = container_of(file->private_data, struct fvdkdata, miscdev);
+	struct fvdk_file *ctx = file->private_data;
+	struct fvdkdata *data = ctx->data;
 
-	size = vma->vm_end - vma->vm_start;
+	if (vma->vm_pgoff == FVDK_MMAP_HEADER_OFFSET >> PAGE_SHIFT)
+		return mapFPGAHeader(data->dev, vma, 0);
+	if (vma->vm_pgoff == FVDK_MMAP_STATUS_OFFSET >> PAGE_SHIFT)
+		return mapFvdkStatus(data->dev, vma);
+	if (vma->vm_pgoff == FVDK_MMAP_LOCK_OFFSET >> PAGE_SHIFT)
+		return mapFvdkLocks(data->dev, vma);
 
-	if (size > (data->pDev.blobsize))
-		return -EINVAL;
-	if (remap_pfn_range(vma, vma->vm_start, __pa(data->pDev.blob) >> PAGE_SHIFT,
-			    size, vma->vm_page_prot))
-		return -EAGAIN;
-	return 0;
+	return mapFvdkBlob(data->dev, vma);
 }
 
 // static int fvdk_suspend(struct platform_device *pdev, pm_message_t state)
@@ -121,10 +206,12 @@ static int fvdk_suspend(struct device *dev)
 	struct fvdkdata *data = dev_get_drvdata(dev);
 
 	dev_dbg(dev, "Suspend FVDK driver\n");
+	flush_work(&data->powerWork);
+	fvdkEvent(dev, FVDK_EV_SUSPEND);
 
 	// Power Down
-	data->ops.pBSPFvdPowerDownFPA(dev);
-	data->ops.pBSPFvdPowerDown(dev);
+	FvdPowerDownFPA(dev);
+	FvdPowerDown(dev);
 	return 0;
 }
 
@@ -137,15 +224,14 @@ static int fvdk_resume(struct device *dev)
 	dev_dbg(dev, "Resume FVDK driver\n");
 
 	// Power Up
-	data->ops.pBSPFvdPowerUp(dev, TRUE);
+	FvdPowerUp(dev, TRUE);
+	fvdkEvent(dev, FVDK_EV_RESUME);
 
 	dev_dbg(dev, "FVDK will load FPGA\n");
 
 	// Load MAIN FPGA
-	if (data->pDev.spi_flash) {
-		data->pDev.fpgaLoaded = FALSE;
+	if (data->pDev.spi_flash)
 		return 0;
-	}
 
 	retval = LoadFPGA(dev, "");
 	if (retval != ERROR_SUCCESS) {
@@ -176,9 +262,30 @@ static int fvdk_probe(struct platform_device *pdev)
 
 	data->pDev.fpgaLoaded = TRUE;
 	data->dev = dev;
+	mutex_init(&data->muLoad);
+	mutex_init(&data->muHeader);
 
 	dev_set_drvdata(dev, data);
 	platform_set_drvdata(pdev, data);
+	initFvdkEvents(dev);
+	INIT_WORK(&data->powerWork, FvdPowerWork);
+	initFvdkBlob(dev);
+	initFvdkPersist(dev);
+
+	ret = initFPGAHeader(dev);
+	if (ret)
+		return ret;
+	ret = initFvdkStatus(dev);
+	if (ret) {
+		freeFPGAHeader(dev);
+		return ret;
+	}
+	ret = initFvdkLocks(dev);
+	if (ret) {
+		freeFvdkStatus(dev);
+		freeFPGAHeader(dev);
+		return ret;
+	}
 
 	data->miscdev.minor = MISC_DYNAMIC_MINOR;
 	data->miscdev.name = "fvdk";
@@ -188,10 +295,15 @@ static int fvdk_probe(struct platform_device *pdev)
 	ret = misc_register(&data->miscdev);
 	if (ret) {
 		dev_err(dev, "%s: Failed to register miscdev for FVDK driver\n", __func__);
+		freeFvdkLocks(dev);
+		freeFvdkStatus(dev);
+		freeFPGAHeader(dev);
 		return -EIO;
 	}
 
-	if (of_machine_is_compatible("fsl,imx6dl-ec101")) {
+	if (fpga_sim) {
+		Setup_FVDK_Sim(dev);
+	} else if (of_machine_is_compatible("fsl,imx6dl-ec101")) {
 		SetupMX6S_ec101(dev);
 	} else if (of_machine_is_compatible("fsl,imx6dl-ec501")) {
 		SetupMX6S_ec501(dev);
@@ -210,9 +322,15 @@ static int fvdk_probe(struct platform_device *pdev)
 		goto ERROR_GPIO_SETUP;
 	}
 
+	watchFvdkPins(dev);
+	updateFvdkPins(dev);
+
 	ret = sysfs_create_group(&dev->kobj, &fvdk_sysfs_group);
 	if (ret)
 		dev_err(dev, "%s: Failed to add sysfs entries\n", __func__);
+	ret = sysfs_create_bin_file(&dev->kobj, &bin_attr_fpga_header);
+	if (ret)
+		dev_err(dev, "%s: Failed to add fpga_header\n", __func__);
 
 	if (data->ops.pGetPinReady(dev) != 0) {
 		int r;
@@ -222,9 +340,6 @@ static int fvdk_probe(struct platform_device *pdev)
 		dev_err(dev, "FVDK Resume %i", r);
 	}
 
-	sema_init(&(data->muDevice), 1);
-	sema_init(&(data->muLepton), 1);
-	sema_init(&(data->muExecute), 1);
 	sema_init(&(data->muStandby), 1);
 
 	return 0;
@@ -232,6 +347,9 @@ static int fvdk_probe(struct platform_device *pdev)
 ERROR_GPIO_SETUP:
 ERROR_UNKNOWN_HARDWARE:
 	misc_deregister(&data->miscdev);
+	freeFvdkLocks(dev);
+	freeFvdkStatus(dev);
+	freeFPGAHeader(dev);
 	return -1;
 }
 
@@ -240,15 +358,20 @@ static int fvdk_remove(struct platform_device *pdev)
 	struct device *dev = &pdev->dev;
 	struct fvdkdata *data = dev_get_drvdata(dev);
 
-	data->ops.pBSPFvdPowerDownFPA(dev);
-	data->ops.pBSPFvdPowerDown(dev);
+	cancel_work_sync(&data->powerWork);
+	FvdPowerDownFPA(dev);
+	FvdPowerDown(dev);
 
-	kfree(data->pDev.blob);
-	data->pDev.blob = NULL;
+	freeFvdkBlob(dev);
 
+	sysfs_remove_bin_file(&dev->kobj, &bin_attr_fpga_header);
 	sysfs_remove_group(&dev->kobj, &fvdk_sysfs_group);
+	unwatchFvdkPins(dev);
 	data->ops.pCleanupGpio(dev);
 	misc_deregister(&data->miscdev);
+	freeFvdkLocks(dev);
+	freeFvdkStatus(dev);
+	freeFPGAHeader(dev);
 	return 0;
 }
 
@@ -257,9 +380,16 @@ static const struct dev_pm_ops fvdk_pm_ops = {
 	.resume_early = fvdk_resume,
 };
 
+// Save a persistent blob for the next boot
+static void fvdk_shutdown(struct platform_device *pdev)
+{
+	freeFvdkBlob(&pdev->dev);
+}
+
 static struct platform_driver fvdk_driver = {
 	.probe = fvdk_probe,
 	.remove = fvdk_remove,
+	.shutdown = fvdk_shutdown,
 	.driver = {
 		   .name = "fvdk",
 		   .owner = THIS_MODULE,
@@ -269,27 +399,81 @@ static struct platform_driver fvdk_driver = {
 
 
 /**
- *  FVD_Open
+ * Read the FPGA header from SPI flash into the header store.
+ * The generic header is read first, it gives the size of the rest.
+ * Nothing is read while the store holds a valid header.
  *
- * @param inode
- * @param file
+ * @return 0 on success, <0 on error
+ */
+static int readFlashHeader(struct fvdkdata *data)
+{
+	GENERIC_FPGA_T *pGen;
+	unsigned char *rxbuf;
+	int ret;
+
+	if (data->pDev.fpgaHeaderValid)
+		return 0;
+
+	// Separate buffer, the flash driver may DMA into it
+	rxbuf = kmalloc(sizeof(GENERIC_FPGA_T), GFP_KERNEL);
+	if (!rxbuf)
+		return -ENOMEM;
+
+	ret = read_spi_header(rxbuf, sizeof(GENERIC_FPGA_T));
+	if (ret == 0) {
+		pGen = (GENERIC_FPGA_T *) rxbuf;
+		if (FPGA_HDR_SIZE(pGen) > min_t(size_t, HEADER_LENGTH,
+						 FPGA_HEADER_MAX_SIZE)) {
+			ret = -EINVAL;
+		} else {
+			size_t len = FPGA_HDR_SIZE(pGen);
+
+			kfree(rxbuf);
+			rxbuf = kmalloc(len, GFP_KERNEL);
+			if (!rxbuf)
+				return -ENOMEM;
+			ret = read_spi_header(rxbuf, len);
+			if (ret == 0)
+				ret = setFPGAHeader(data->dev, rxbuf, len);
+		}
+	}
+	if (ret < 0)
+		dev_err(data->dev, "Failed to read data from SPI flash\n");
+
+	kfree(rxbuf);
+	return ret;
+}
+
+/**
+ *  FVD_Init, powers up and loads the FPGA on first open
+ *
+ * @param data
  *
  * @return
  */
-static int FVD_Open(struct inode *inode, struct file *file)
+static int FVD_Init(struct fvdkdata *data)
 {
 
 	int ret = -1;
-	struct fvdkdata *data = container_of(file->private_data, struct fvdkdata, miscdev);
 	struct device *dev = data->dev;
 	static BOOL init;
 	DWORD dwStatus;
 	DWORD timeout = 50;
 
-	if (init)
+	if (init) {
+		// Header cache invalidated by a flash update. muLoad, not
+		// LDRV, so open doesn't wait for lock holders.
+		if (data->pDev.spi_flash && !READ_ONCE(data->pDev.fpgaHeaderValid)) {
+			if (mutex_lock_interruptible(&data->muLoad))
+				return -ERESTARTSYS;
+			readFlashHeader(data);
+			mutex_unlock(&data->muLoad);
+		}
 		return 0;
+	}
 
-	down(&(data->muDevice));
+	if (lockFvdk(data, NULL, LDRV, 0))
+		return -ERESTARTSYS;
 
 	if (data->pDev.spi_flash) {
 		// For ROCO the FPGA is configured through an SPI NOR Flash memory,
@@ -298,31 +482,14 @@ static int FVD_Open(struct inode *inode, struct file *file)
 		// However We need to read out the Header data configured inte to FLASH
 		// the header data from the fpga.bin file is stored 64 kbit from the end of the
 		// memory, 2**28 - 2**16 = 256Mbit - 64 kBit
-		unsigned char *rxbuf;
+		FvdPowerUp(dev, FALSE);
 
-		data->ops.pBSPFvdPowerUp(dev, FALSE);
-
-		rxbuf = vmalloc(sizeof(unsigned char) * HEADER_LENGTH);
-		if (!rxbuf) {
-			ret = -1;
-			goto SPI_FAIL;
-		}
-		ret = read_spi_header(rxbuf);
-		if (ret < 0) {
-			dev_err(dev, "Failed to read data from SPI flash\n");
-			goto SPI_FAIL;
-		}
-
-		memcpy(data->pDev.fpga, rxbuf, sizeof(data->pDev.fpga));
-		ret = 0;
-
-		init = TRUE;   // only if successful open
-SPI_FAIL:
-		vfree(rxbuf);
-		rxbuf = 0;
+		ret = readFlashHeader(data);
+		if (ret == 0)
+			init = TRUE;   // only if successful open
 
 	} else {
-		data->ops.pBSPFvdPowerUp(dev, FALSE);
+		FvdPowerUp(dev, FALSE);
 
 		dev_info(dev, "FVD will load FPGA\n");
 
@@ -345,16 +512,75 @@ SPI_FAIL:
 		ret = 0;
 	}
 END:
-	up(&(data->muDevice));
+	unlockFvdk(data, NULL, LDRV);
 
 	return ret;
 }
 
+/**
+ *  FVD_Open
+ *
+ * @param inode
+ * @param file
+ *
+ * @return
+ */
+static int FVD_Open(struct inode *inode, struct file *file)
+{
+	struct fvdkdata *data = container_of(file->private_data, struct fvdkdata, miscdev);
+	struct fvdk_file *ctx;
+	int ret;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	ret = FVD_Init(data);
+	if (ret) {
+		kfree(ctx);
+		return ret;
+	}
+
+	addFvdkFile(data, ctx);
+	file->private_data = ctx;
+	return 0;
+}
+
+static int FVD_Release(struct inode *inode, struct file *file)
+{
+	struct fvdk_file *ctx = file->private_data;
+
+	releaseFvdkLocks(ctx);
+	removeFvdkFile(ctx);
+	kfree(ctx);
+	return 0;
+}
+
+// Errors that are a normal outcome of an ioctl, not a failure
+static BOOL expectedError(unsigned int cmd, long err)
+{
+	switch (cmd) {
+	case IOCTL_FVDK_LOCK:
+	case IOCTL_FVDK_LOCK_WAIT:
+		return err == -ETIME || err == -EINTR;
+	case IOCTL_FVDK_LOCK_ACQUIRE:
+		return err == -EBUSY || err == -ETIME || err == -EINTR;
+	case IOCTL_FVDK_LOCK_ASYNC:
+		return err == -EALREADY;
+	case IOCTL_FVDK_REGION_LOOKUP:
+	case IOCTL_FVDK_LOCK_LOOKUP:
+		return err == -ENOENT;
+	default:
+		return FALSE;
+	}
+}
+
 static long FVD_IOControl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	long err = ERROR_SUCCESS;
 	char *tmp;
-	struct fvdkdata *data = container_of(file->private_data, struct fvdkdata, miscdev);
+	struct fvdk_file *ctx = file->private_data;
+	struct fvdkdata *data = ctx->data;
 	struct device *dev = data->dev;
 
 	tmp = kzalloc(_IOC_SIZE(cmd), GFP_KERNEL);
@@ -364,6 +590,12 @@ static long FVD_IOControl(struct file *file, unsigned int cmd, unsigned long arg
 			dev_err(dev, "FVD: Copy from user failed: %ld\n", err);
 	}
 
+	// Header queries don't have to wait for the FPGA load
+	if (!data->pDev.fpgaHeaderValid && !data->pDev.spi_flash &&
+	    (cmd == IOCTL_FVDK_GET_FPGA_GENERIC || cmd == IOCTL_FVDK_GET_FPGA_DATA ||
+	     cmd == IOCTL_FVDK_GET_FPGA_BUF || cmd == IOCTL_FVDK_GET_FPGA_BUF_IDX))
+		getFPGAHeader(dev);
+
 	if (err == ERROR_SUCCESS) {
 		switch (cmd) {
 		case IOCTL_FVDK_GET_VERSION:	// return driver version
@@ -372,114 +604,196 @@ static long FVD_IOControl(struct file *file, unsigned int cmd, unsigned long arg
 			break;
 
 		case IOCTL_FVDK_POWER_UP:
-			data->ops.pBSPFvdPowerUp(dev, FALSE);
+			FvdPowerUp(dev, FALSE);
 			err = ERROR_SUCCESS;
 			break;
 
+		case IOCTL_FVDK_POWER_UP_ASYNC:
+		{
+			struct fvdk_power_async *req = (struct fvdk_power_async *)tmp;
+
+			if (req->flags & ~FVDK_POWER_RESTART) {
+				err = ERROR_INVALID_PARAMETER;
+				break;
+			}
+			atomic_or(req->flags, &data->powerFlags);
+			req->seq = atomic_inc_return(&data->powerSeq);
+			fvdkPowerQueued(dev, req->seq);
+			queue_work(system_long_wq, &data->powerWork);
+			err = ERROR_SUCCESS;
+		}
+		break;
+
+		case IOCTL_FVDK_POWER_WAIT:
+		{
+			struct fvdk_power_wait *req = (struct fvdk_power_wait *)tmp;
+			long timeout = req->timeout_ms ?
+				msecs_to_jiffies(req->timeout_ms) : MAX_SCHEDULE_TIMEOUT;
+			u32 res;
+
+			// Not handed out yet, would never complete
+			if ((s32)(req->seq - atomic_read(&data->powerSeq)) > 0) {
+				err = ERROR_INVALID_PARAMETER;
+				break;
+			}
+			timeout = wait_event_interruptible_timeout(data->eventWait,
+				(s32)(fvdkPowerCompleted(dev, &res) - req->seq) >= 0,
+				timeout);
+			if (timeout == 0) {
+				err = -ETIMEDOUT;
+			} else if (timeout < 0) {
+				err = timeout;
+			} else {
+				fvdkPowerCompleted(dev, &req->result);
+				err = ERROR_SUCCESS;
+			}
+		}
+		break;
+
 		case IOCTL_FVDK_POWER_DOWN:
-			data->ops.pBSPFvdPowerDown(dev);
+			FvdPowerDown(dev);
 			err = ERROR_SUCCESS;
 			break;
 
 		case IOCTL_FVDK_POWER_UP_FPA:
-			data->ops.pBSPFvdPowerUpFPA(dev);
+			FvdPowerUpFPA(dev);
 			err = ERROR_SUCCESS;
 			break;
 
 		case IOCTL_FVDK_POWER_DOWN_FPA:
-			data->ops.pBSPFvdPowerDownFPA(dev);
+			FvdPowerDownFPA(dev);
 			err = ERROR_SUCCESS;
 			break;
 
 		case IOCTL_FVDK_GET_FPGA_GENERIC:
-			memcpy(tmp, &(data->pDev.fpga[0]), sizeof(GENERIC_FPGA_T));
+			copyFPGAHeader(dev, 0, tmp, sizeof(GENERIC_FPGA_T));
 			err = ERROR_SUCCESS;
 			break;
 
 		case IOCTL_FVDK_GET_FPGA_DATA:
-			memcpy(tmp, &(data->pDev.fpga[sizeof(GENERIC_FPGA_T)]),
-			       sizeof(BXAB_FPGA_T));
+			copyFPGAHeader(dev, sizeof(GENERIC_FPGA_T), tmp,
+				       sizeof(BXAB_FPGA_T));
 			err = ERROR_SUCCESS;
 			break;
 
 		case IOCTL_FVDK_GET_FPGA_BUF:
+			// At most noOfBuffers entries that fit in the header
+			err = copyFPGABufTable(dev, (void __user *)arg);
+			break;
+
+		case IOCTL_FVDK_GET_FPGA_BUF_IDX:
 		{
-			BXAB_FPGA_T *pSpec =
-				(BXAB_FPGA_T *) &(data->pDev.fpga[sizeof(GENERIC_FPGA_T)]);
+			struct fvdk_fpga_buf *req = (struct fvdk_fpga_buf *)tmp;
 
-			err = copy_to_user((void *)arg,
-					   &(data->pDev.fpga[sizeof(GENERIC_FPGA_T) +
-							     sizeof(BXAB_FPGA_T)]),
-					   pSpec->noOfBuffers * sizeof(SDRAM_BUF_T));
+			err = getFPGABuf(dev, req->index, &req->buf);
 		}
 		break;
 
+		case IOCTL_FVDK_LOAD_PARTIAL:
+		{
+			struct fvdk_load_partial *req = (struct fvdk_load_partial *)tmp;
+
+			req->name[sizeof(req->name) - 1] = 0;
+			err = LoadFPGAPartial(dev, req->name);
+		}
+		break;
+
+		case IOCTL_FVDK_LOAD_USER:
+			err = LoadFPGAUser(dev, (struct fvdk_load_user *)tmp);
+			break;
+
+		case IOCTL_FVDK_FLASH_UPDATE:
+			if (data->pDev.spi_flash)
+				err = update_spi_flash(dev, (struct fvdk_flash_update *)tmp);
+			else
+				err = ERROR_NOT_SUPPORTED;
+			break;
+
+		case IOCTL_FVDK_SET_EVENTS:
+			err = setFvdkEvents(ctx, (struct fvdk_events *)tmp);
+			break;
+
+		case IOCTL_FVDK_GET_EVENTS:
+			*(u32 *)tmp = getFvdkEvents(ctx);
+			err = ERROR_SUCCESS;
+			break;
+
 		case IOCTL_FVDK_CREATE_BLOB:
-			if (data->pDev.blob)
-				err = ERROR_SUCCESS;
-			else {
-				data->pDev.blobsize =
-					(*(ULONG *) tmp + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-				data->pDev.blob = kmalloc(data->pDev.blobsize, GFP_KERNEL);
-				if (data->pDev.blob == NULL) {
-					dev_err(dev, "FVDK : Error allocating memory\n");
-					data->pDev.blobsize = 0;
-					err = -ENOMEM;
-				} else {
-					memset(data->pDev.blob, 0, data->pDev.blobsize);
-					err = ERROR_SUCCESS;
-				}
-			}
+			err = createFvdkBlob(dev, *(ULONG *) tmp);
 			break;
 
-		case IOCTL_FVDK_LOCK:
-		{
-			int lock = *(ULONG *) tmp >> 16;
-			int unlock = *(ULONG *) tmp & 0xFFFF;
+		case IOCTL_FVDK_BLOB_EXPORT:
+			err = exportFvdkBlob(dev, (struct fvdk_blob_export *)tmp);
+			break;
 
-			switch (unlock) {
-			case LDRV:
-				up(&(data->muDevice));
-				break;
-			case LEXEC:
-				up(&(data->muExecute));
-				break;
-			case LLEPT:
-				up(&(data->muLepton));
-				break;
-			}
+		case IOCTL_FVDK_BLOB_INFO:
+			getFvdkBlobInfo(dev, (struct fvdk_blob_info *)tmp);
 			err = ERROR_SUCCESS;
-			switch (lock) {
-			case LNONE:
-				break;
-			case LDRV:
-				if (lock_timeout)
-					err = down_timeout(&(data->muDevice),
-							   msecs_to_jiffies(lock_timeout));
-				else
-					down(&(data->muDevice));
-				break;
-			case LEXEC:
-				if (lock_timeout)
-					err = down_timeout(&(data->muExecute),
-							   msecs_to_jiffies(lock_timeout));
-				else
-					down(&(data->muExecute));
-				break;
-			case LLEPT:
-				if (lock_timeout)
-					err = down_timeout(&(data->muLepton),
-							   msecs_to_jiffies(lock_timeout));
-				else
-					down(&(data->muLepton));
-				break;
-			default:
-				err = ERROR_INVALID_PARAMETER;
-			}
-			if (err)
-				dev_err(dev, "Lock failed %d %d %d\n", unlock, lock, (int)err);
-		}
-		break;
+			break;
+
+		case IOCTL_FVDK_BLOB_RESIZE:
+			err = resizeFvdkBlob(dev, *(__u64 *) tmp);
+			break;
+
+		case IOCTL_FVDK_BLOB_CHECKPOINT:
+			err = checkpointFvdkBlob(dev, (struct fvdk_blob_checkpoint *)tmp);
+			break;
+
+		case IOCTL_FVDK_BLOB_RESTORE:
+			err = restoreFvdkBlob(dev, *(__s32 *) tmp);
+			break;
+
+		case IOCTL_FVDK_REGION_CREATE:
+			err = createFvdkRegion(dev, (struct fvdk_region *)tmp);
+			break;
+
+		case IOCTL_FVDK_REGION_LOOKUP:
+			err = findFvdkRegion(dev, (struct fvdk_region *)tmp);
+			break;
+
+		case IOCTL_FVDK_REGION_DELETE:
+			err = deleteFvdkRegion(dev, (struct fvdk_region *)tmp);
+			break;
+
+		case IOCTL_FVDK_LOCK:
+			err = fvdkLockIoctl(ctx, *(ULONG *) tmp, lock_timeout);
+			break;
+
+		case IOCTL_FVDK_LOCK_INFO:
+			err = getFvdkLockInfo(ctx, (struct fvdk_lock_info *)tmp);
+			break;
+
+		case IOCTL_FVDK_LOCK_WAIT:
+			err = waitFvdkLock(data, (struct fvdk_lock_wait *)tmp);
+			break;
+
+		case IOCTL_FVDK_LOCK_WAKE:
+			err = wakeFvdkLock(ctx, *(__u32 *) tmp);
+			break;
+
+		case IOCTL_FVDK_LOCK_ACQUIRE:
+			err = acquireFvdkLocks(ctx, (struct fvdk_lock_set *)tmp);
+			break;
+
+		case IOCTL_FVDK_LOCK_RELEASE:
+			err = releaseFvdkLockSet(ctx, (struct fvdk_lock_set *)tmp);
+			break;
+
+		case IOCTL_FVDK_LOCK_ASYNC:
+			err = queueFvdkLock(ctx, (struct fvdk_lock_async *)tmp);
+			break;
+
+		case IOCTL_FVDK_LOCK_CANCEL:
+			err = cancelFvdkLock(ctx, (struct fvdk_lock_async *)tmp);
+			break;
+
+		case IOCTL_FVDK_LOCK_CREATE:
+			err = createFvdkLock(data, (struct fvdk_lock_name *)tmp);
+			break;
+
+		case IOCTL_FVDK_LOCK_LOOKUP:
+			err = findFvdkLock(data, (struct fvdk_lock_name *)tmp);
+			break;
 
 		default:
 			dev_warn(dev, "FVDK: Ioctl %u not supported\n", cmd);
@@ -488,7 +802,9 @@ static long FVD_IOControl(struct file *file, unsigned int cmd, unsigned long arg
 		}
 	}
 
-	if (err)
+	if (err && expectedError(cmd, err))
+		dev_dbg(dev, "FVD Ioctl %X returned %ld\n", cmd, err);
+	else if (err)
 		dev_err(dev, "FVD Ioctl %X failed: %ld\n", cmd, err);
 
 	if ((err == ERROR_SUCCESS) && (_IOC_DIR(cmd) & _IOC_READ)) {
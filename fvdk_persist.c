@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ *    FLIR Video Device driver.
+ *    Blob persistence in reserved memory
+ *
+ *    With a memory-region phandle in the device tree node, blob pages
+ *    are taken from that region instead of the page allocator. The
+ *    first page of the region holds a header that is written when the
+ *    blob is freed, at module unload or reboot. A later instance of
+ *    the driver that finds a valid header recreates the blob with its
+ *    contents and regions, so user space need not rebuild it.
+ *
+ *    The region must not be no-map, blob pages need struct pages.
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "flir_kernel_os.h"
+#include "fpga.h"
+#include "fvdk_internal.h"
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/highmem.h>
+#include <linux/crc32.h>
+#include <linux/mm.h>
+
+#define FVDK_PERSIST_MAGIC	0x42445646	// "FVDB"
+#define FVDK_PERSIST_VERSION	2
+
+struct fvdk_persist_header {
+	__le32 magic;
+	__le32 version;
+	__le64 size;		// Blob size in bytes
+	__le32 data_crc;	// Over size bytes following the header page
+	__le32 header_crc;	// Over the header with this field zero
+	__le32 nregions;
+	__le32 regions_crc;	// Over the nregions entries of regions
+	struct fvdk_persist_region regions[];
+};
+
+static u32 regionsCrc(struct fvdk_persist_header *hdr, u32 n)
+{
+	return crc32_le(~0, (const u8 *)hdr->regions,
+			n * sizeof(hdr->regions[0]));
+}
+
+static u32 headerCrc(struct fvdk_persist_header *hdr)
+{
+	struct fvdk_persist_header tmp = *hdr;
+
+	tmp.header_crc = 0;
+	return crc32_le(~0, (const u8 *)&tmp, sizeof(tmp));
+}
+
+// CRC of the first npages blob pages of the region
+static u32 dataCrc(struct fvdk_blob *blob, unsigned long npages)
+{
+	u32 crc = ~0;
+	unsigned long i;
+
+	for (i = 0; i < npages; i++) {
+		void *p = kmap(pfn_to_page(blob->persistPfn + i));
+
+		crc = crc32_le(crc, p, PAGE_SIZE);
+		kunmap(pfn_to_page(blob->persistPfn + i));
+		cond_resched();
+	}
+	return crc;
+}
+
+/**
+ * Check the header of the region
+ *
+ * @return blob pages to restore, 0 if the header is not valid
+ */
+static unsigned long checkHeader(struct device *dev, struct fvdk_blob *blob,
+				 struct fvdk_persist_header *hdr)
+{
+	u64 size = le64_to_cpu(hdr->size);
+	u32 nregions = le32_to_cpu(hdr->nregions);
+	unsigned long npages;
+
+	if (le32_to_cpu(hdr->magic) != FVDK_PERSIST_MAGIC)
+		return 0;
+	if (le32_to_cpu(hdr->header_crc) != headerCrc(hdr) ||
+	    le32_to_cpu(hdr->version) != FVDK_PERSIST_VERSION) {
+		dev_warn(dev, "Persistent blob header not valid\n");
+		return 0;
+	}
+	if (!size || size > (u64)blob->persistPages << PAGE_SHIFT) {
+		dev_warn(dev, "Persistent blob size %llu does not fit\n", size);
+		return 0;
+	}
+	if (nregions > FVDK_PERSIST_REGIONS ||
+	    le32_to_cpu(hdr->regions_crc) != regionsCrc(hdr, nregions)) {
+		dev_warn(dev, "Persistent blob region table not valid\n");
+		return 0;
+	}
+
+	npages = size >> PAGE_SHIFT;
+	if (le32_to_cpu(hdr->data_crc) != dataCrc(blob, npages)) {
+		dev_warn(dev, "Persistent blob checksum mismatch\n");
+		return 0;
+	}
+	return npages;
+}
+
+/**
+ * Back the blob with the memory-region of the device, if there is
+ * one, and restore the blob saved in it
+ */
+void initFvdkPersist(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_blob *blob = &data->blob;
+	struct fvdk_persist_header *hdr;
+	struct device_node *np;
+	struct reserved_mem *rmem;
+	unsigned long pfn, npages, restore;
+
+	BUILD_BUG_ON(sizeof(*hdr) + FVDK_PERSIST_REGIONS *
+		     sizeof(hdr->regions[0]) > PAGE_SIZE);
+
+	np = of_parse_phandle(dev->of_node, "memory-region", 0);
+	if (!np)
+		return;
+	rmem = of_reserved_mem_lookup(np);
+	of_node_put(np);
+	if (!rmem) {
+		dev_warn(dev, "Blob memory-region not reserved\n");
+		return;
+	}
+
+	pfn = PFN_UP(rmem->base);
+	npages = PFN_DOWN(rmem->base + rmem->size) - pfn;
+	if (npages < 2 || !pfn_valid(pfn) || !pfn_valid(pfn + npages - 1)) {
+		dev_warn(dev, "Blob memory-region unusable (no-map or too small)\n");
+		return;
+	}
+
+	mutex_lock(&blob->lock);
+	blob->persistPfn = pfn + 1;
+	blob->persistPages = npages - 1;
+	mutex_unlock(&blob->lock);
+
+	// The region table is used below, the header page isn't blob data
+	hdr = kmap(pfn_to_page(pfn));
+	restore = checkHeader(dev, blob, hdr);
+	// Invalid from here until saved again
+	hdr->magic = 0;
+
+	dev_info(dev, "Persistent blob, %lu KiB\n", blob->persistPages << (PAGE_SHIFT - 10));
+	if (!restore)
+		goto out;
+
+	if (createFvdkBlob(dev, restore << PAGE_SHIFT)) {
+		dev_err(dev, "Failed to restore persistent blob\n");
+		goto out;
+	}
+	mutex_lock(&blob->lock);
+	blob->persistValid = restore;
+	blob->restored = TRUE;
+	if (restoreFvdkRegions(blob, hdr->regions, le32_to_cpu(hdr->nregions)))
+		dev_warn(dev, "Persistent blob regions not restored\n");
+	mutex_unlock(&blob->lock);
+	dev_info(dev, "Restored blob, %lu KiB, %u regions\n",
+		 restore << (PAGE_SHIFT - 10), le32_to_cpu(hdr->nregions));
+out:
+	kunmap(pfn_to_page(pfn));
+}
+
+/**
+ * Save the blob header and regions so the contents survive. Pages
+ * never handed out are cleared, the next instance treats them as blob
+ * data. Call with blob lock held, before the regions are freed.
+ */
+void saveFvdkPersist(struct fvdk_blob *blob)
+{
+	struct fvdk_persist_header *hdr;
+	struct page *page;
+	unsigned long i;
+	u32 crc, n;
+
+	if (!blob->persistPages || !blob->pages)
+		return;
+
+	for (i = 0; i < blob->npages; i++) {
+		page = pfn_to_page(blob->persistPfn + i);
+		if (!blob->pages[i] && i >= blob->persistValid)
+			clear_highpage(page);
+		flush_dcache_page(page);
+	}
+	crc = dataCrc(blob, blob->npages);
+
+	page = pfn_to_page(blob->persistPfn - 1);
+	hdr = kmap(page);
+	hdr->version = cpu_to_le32(FVDK_PERSIST_VERSION);
+	hdr->size = cpu_to_le64((u64)blob->npages << PAGE_SHIFT);
+	hdr->data_crc = cpu_to_le32(crc);
+	n = saveFvdkRegions(blob, hdr->regions);
+	hdr->nregions = cpu_to_le32(n);
+	hdr->regions_crc = cpu_to_le32(regionsCrc(hdr, n));
+	hdr->magic = cpu_to_le32(FVDK_PERSIST_MAGIC);
+	hdr->header_crc = cpu_to_le32(headerCrc(hdr));
+	kunmap(page);
+	flush_dcache_page(page);
+}
@@ -0,0 +1,304 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ *    FLIR Video Device driver.
+ *    Named regions inside the blob
+ *
+ *    Regions are page aligned ranges of the blob, allocated first fit
+ *    and found by name. A process maps a region by passing its offset
+ *    to mmap(), so it only maps what it uses and no process has to
+ *    know the layout of the others.
+ *
+ *    The regions of a persistent blob are saved and restored with it,
+ *    at most FVDK_PERSIST_REGIONS of them.
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "flir_kernel_os.h"
+#include "fpga.h"
+#include "fvdk_internal.h"
+#include "fvdk_ioctl.h"
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/highmem.h>
+#include <linux/log2.h>
+
+struct fvdk_region_entry {
+	struct list_head list;		// In offset order
+	char name[FVDK_REGION_NAME_LEN];
+	unsigned long first;		// Blob page index
+	unsigned long npages;
+	unsigned long align;		// In pages
+};
+
+static BOOL validName(const char *name)
+{
+	size_t len = strnlen(name, FVDK_REGION_NAME_LEN);
+
+	return len > 0 && len < FVDK_REGION_NAME_LEN;
+}
+
+// Call with blob lock held
+static struct fvdk_region_entry *findRegion(struct fvdk_blob *blob,
+					     const char *name)
+{
+	struct fvdk_region_entry *r;
+
+	list_for_each_entry(r, &blob->regions, list)
+		if (!strcmp(r->name, name))
+			return r;
+	return NULL;
+}
+
+static void regionInfo(const struct fvdk_region_entry *r,
+		       struct fvdk_region *req)
+{
+	req->offset = (__u64)r->first << PAGE_SHIFT;
+	req->size = (__u64)r->npages << PAGE_SHIFT;
+	req->align = (__u64)r->align << PAGE_SHIFT;
+}
+
+/**
+ * Free all regions. Call with blob lock held.
+ */
+void freeFvdkRegions(struct fvdk_blob *blob)
+{
+	struct fvdk_region_entry *r, *next;
+
+	list_for_each_entry_safe(r, next, &blob->regions, list) {
+		list_del(&r->list);
+		kfree(r);
+	}
+}
+
+/**
+ * Get the end of the last region, in pages. Call with blob lock held.
+ */
+unsigned long fvdkRegionsEnd(struct fvdk_blob *blob)
+{
+	struct fvdk_region_entry *r;
+
+	if (list_empty(&blob->regions))
+		return 0;
+	r = list_last_entry(&blob->regions, struct fvdk_region_entry, list);
+	return r->first + r->npages;
+}
+
+/**
+ * Save the regions in offset order. Call with blob lock held.
+ *
+ * @param table room for FVDK_PERSIST_REGIONS entries
+ *
+ * @return number of regions saved
+ */
+unsigned int saveFvdkRegions(struct fvdk_blob *blob,
+			     struct fvdk_persist_region *table)
+{
+	struct fvdk_region_entry *r;
+	unsigned int n = 0;
+
+	list_for_each_entry(r, &blob->regions, list) {
+		if (n == FVDK_PERSIST_REGIONS)
+			break;
+		memset(&table[n], 0, sizeof(table[n]));
+		strscpy(table[n].name, r->name, sizeof(table[n].name));
+		table[n].first = cpu_to_le64(r->first);
+		table[n].npages = cpu_to_le64(r->npages);
+		table[n].align = cpu_to_le64(r->align);
+		n++;
+	}
+	return n;
+}
+
+/**
+ * Recreate saved regions, without clearing their pages. Call with
+ * blob lock held, on a blob without regions.
+ *
+ * @return 0 on success, -EINVAL if the table doesn't fit the blob
+ */
+int restoreFvdkRegions(struct fvdk_blob *blob,
+		       const struct fvdk_persist_region *table, unsigned int n)
+{
+	struct fvdk_region_entry *r;
+	unsigned long end = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		u64 first = le64_to_cpu(table[i].first);
+		u64 npages = le64_to_cpu(table[i].npages);
+		u64 align = le64_to_cpu(table[i].align);
+
+		// In offset order, without overlap, inside the blob
+		if (!validName(table[i].name) || !npages || !align ||
+		    first < end || first > blob->npages ||
+		    npages > blob->npages - first ||
+		    findRegion(blob, table[i].name))
+			goto err;
+
+		r = kzalloc(sizeof(*r), GFP_KERNEL);
+		if (!r)
+			goto err;
+		strscpy(r->name, table[i].name, sizeof(r->name));
+		r->first = first;
+		r->npages = npages;
+		r->align = align;
+		list_add_tail(&r->list, &blob->regions);
+		end = first + npages;
+	}
+	return 0;
+
+err:
+	freeFvdkRegions(blob);
+	return -EINVAL;
+}
+
+/**
+ * Create a named region
+ *
+ * @param req name, size and alignment (0 for page alignment),
+ *            returns offset and rounded size
+ *
+ * @return 0 on success, <0 on error
+ */
+int createFvdkRegion(struct device *dev, struct fvdk_region *req)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_blob *blob = &data->blob;
+	struct fvdk_region_entry *r, *pos;
+	struct list_head *prev;
+	unsigned long npages, align, first, i;
+	int ret = 0;
+
+	if (!validName(req->name) || !req->size ||
+	    (req->align && !is_power_of_2(req->align)))
+		return -EINVAL;
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+	strscpy(r->name, req->name, sizeof(r->name));
+
+	mutex_lock(&blob->lock);
+	if (!blob->pages) {
+		ret = -ENODEV;
+		goto err;
+	}
+	if (req->size > (__u64)blob->npages << PAGE_SHIFT ||
+	    req->align > (__u64)blob->npages << PAGE_SHIFT) {
+		ret = -EINVAL;
+		goto err;
+	}
+	npages = PAGE_ALIGN(req->size) >> PAGE_SHIFT;
+	align = max_t(unsigned long, req->align >> PAGE_SHIFT, 1);
+	r->npages = npages;
+	r->align = align;
+	if (findRegion(blob, r->name)) {
+		ret = -EEXIST;
+		goto err;
+	}
+	// Only so many are saved with a persistent blob
+	if (blob->persistPages) {
+		unsigned int count = 0;
+
+		list_for_each_entry(pos, &blob->regions, list)
+			count++;
+		if (count >= FVDK_PERSIST_REGIONS) {
+			ret = -ENOSPC;
+			goto err;
+		}
+	}
+
+	// First fit, the list is kept in offset order
+	first = 0;
+	prev = &blob->regions;
+	list_for_each_entry(pos, &blob->regions, list) {
+		if (first + npages <= pos->first)
+			break;
+		first = ALIGN(pos->first + pos->npages, align);
+		prev = &pos->list;
+	}
+	if (first + npages > blob->npages) {
+		ret = -ENOSPC;
+		goto err;
+	}
+	r->first = first;
+	list_add(&r->list, prev);
+
+	// Don't hand out what a deleted region left behind
+	for (i = first; i < first + npages; i++)
+		if (blob->pages[i])
+			clear_highpage(blob->pages[i]);
+
+	regionInfo(r, req);
+	mutex_unlock(&blob->lock);
+	return 0;
+
+err:
+	mutex_unlock(&blob->lock);
+	kfree(r);
+	return ret;
+}
+
+/**
+ * Look up a region by name
+ *
+ * @param req name, returns offset, size and alignment
+ *
+ * @return 0 on success, -ENOENT if there is no such region
+ */
+int findFvdkRegion(struct device *dev, struct fvdk_region *req)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_blob *blob = &data->blob;
+	struct fvdk_region_entry *r;
+	int ret = 0;
+
+	if (!validName(req->name))
+		return -EINVAL;
+
+	mutex_lock(&blob->lock);
+	r = findRegion(blob, req->name);
+	if (r)
+		regionInfo(r, req);
+	else
+		ret = -ENOENT;
+	mutex_unlock(&blob->lock);
+
+	return ret;
+}
+
+/**
+ * Delete a region by name. Refused while a mapping overlaps it, as
+ * the range may be handed out and cleared again once deleted.
+ *
+ * @return 0 on success, -ENOENT if there is no such region, -EBUSY if
+ *         it is mapped
+ */
+int deleteFvdkRegion(struct device *dev, const struct fvdk_region *req)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	struct fvdk_blob *blob = &data->blob;
+	struct fvdk_region_entry *r;
+	int ret = 0;
+
+	if (!validName(req->name))
+		return -EINVAL;
+
+	mutex_lock(&blob->lock);
+	r = findRegion(blob, req->name);
+	if (!r) {
+		ret = -ENOENT;
+	} else if (fvdkBlobMapped(blob, r->first, r->first + r->npages)) {
+		ret = -EBUSY;
+		r = NULL;
+	} else {
+		list_del(&r->list);
+	}
+	mutex_unlock(&blob->lock);
+
+	kfree(r);
+	return ret;
+}
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ *    FLIR Video Device driver.
+ *    Simulated FPGA backend
+ *
+ *    Selected with the fpga_sim module parameter instead of a board.
+ *    Bitstreams are accepted through pWriteFpgaData and the pins
+ *    follow from the simulated state, so the full and partial load
+ *    paths can be exercised without FPGA hardware. fpga_sim_crc
+ *    makes the next write fail the way a CRC error does.
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "flir_kernel_os.h"
+#include "fpga.h"
+#include "fvdkernel.h"
+#include "fvdk_internal.h"
+#include <linux/platform_device.h>
+#include <linux/version.h>
+#include <linux/module.h>
+
+static bool fpga_sim_crc;
+module_param(fpga_sim_crc, bool, 0644);
+MODULE_PARM_DESC(fpga_sim_crc, "Fail the next simulated FPGA write with a CRC error");
+
+static BOOL SetupGpioAccessSim(struct device *dev);
+static void CleanupGpioSim(struct device *dev);
+static BOOL GetPinDoneSim(struct device *dev);
+static BOOL GetPinStatusSim(struct device *dev);
+static BOOL GetPinReadySim(struct device *dev);
+static DWORD PutInProgrammingModeSim(struct device *dev);
+static void BSPFvdPowerUpSim(struct device *dev, BOOL restart);
+static void BSPFvdPowerDownSim(struct device *dev);
+static void BSPFvdPowerUpFPASim(struct device *dev);
+static void BSPFvdPowerDownFPASim(struct device *dev);
+static DWORD WriteFpgaDataSim(struct device *dev, const void *buf, ULONG size);
+
+// Local variables
+static bool fpgaIsEnabled;
+static bool confDone;		// CONF_DONE
+static bool nStatus;		// nSTATUS, low on a configuration error
+static unsigned long received;	// Bitstream bytes since programming mode
+
+// Code
+void Setup_FVDK_Sim(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	PFVD_DEV_INFO pDev = &data->pDev;
+
+	data->ops.pSetupGpioAccess = SetupGpioAccessSim;
+	data->ops.pCleanupGpio = CleanupGpioSim;
+	data->ops.pGetPinDone = GetPinDoneSim;
+	data->ops.pGetPinStatus = GetPinStatusSim;
+	data->ops.pGetPinReady = GetPinReadySim;
+	data->ops.pPutInProgrammingMode = PutInProgrammingModeSim;
+	data->ops.pBSPFvdPowerUp = BSPFvdPowerUpSim;
+	data->ops.pBSPFvdPowerDown = BSPFvdPowerDownSim;
+	data->ops.pBSPFvdPowerUpFPA = BSPFvdPowerUpFPASim;
+	data->ops.pBSPFvdPowerDownFPA = BSPFvdPowerDownFPASim;
+	data->ops.pWriteFpgaData = WriteFpgaDataSim;
+	pDev->iI2c = -1;	// No mainboard EEPROM
+	pDev->spi_flash = false;	// Loaded by the driver
+}
+
+BOOL SetupGpioAccessSim(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	data->fpga_pins.ready_gpio = -EINVAL;
+
+	// As if loaded by the boot loader
+	fpgaIsEnabled = true;
+	confDone = true;
+	nStatus = true;
+	dev_info(dev, "Using simulated FPGA\n");
+	return TRUE;
+}
+
+void CleanupGpioSim(struct device *dev)
+{
+	fpgaIsEnabled = false;
+}
+
+BOOL GetPinDoneSim(struct device *dev)
+{
+	return confDone;
+}
+
+BOOL GetPinStatusSim(struct device *dev)
+{
+	return nStatus;
+}
+
+// READY is low while the FPGA is configured
+BOOL GetPinReadySim(struct device *dev)
+{
+	return !confDone;
+}
+
+DWORD PutInProgrammingModeSim(struct device *dev)
+{
+	if (!fpgaIsEnabled)
+		return 0;
+
+	confDone = false;
+	nStatus = true;
+	received = 0;
+	return 1;
+}
+
+DWORD WriteFpgaDataSim(struct device *dev, const void *buf, ULONG size)
+{
+	if (!fpgaIsEnabled)
+		return ERROR_IO_DEVICE;
+
+	if (fpga_sim_crc) {
+		fpga_sim_crc = false;
+		nStatus = false;
+		confDone = false;
+		dev_info(dev, "Simulated FPGA CRC error after %lu bytes\n",
+			 received);
+		return ERROR_SUCCESS;
+	}
+
+	received += size;
+	// Configuration completes with the data, also for partial loads
+	if (nStatus)
+		confDone = true;
+	return ERROR_SUCCESS;
+}
+
+void BSPFvdPowerUpSim(struct device *dev, BOOL restart)
+{
+	// An unpowered or restarted FPGA loses its configuration
+	if (!fpgaIsEnabled || restart) {
+		confDone = false;
+		nStatus = true;
+	}
+	fpgaIsEnabled = true;
+}
+
+void BSPFvdPowerDownSim(struct device *dev)
+{
+	fpgaIsEnabled = false;
+	confDone = false;
+}
+
+// No FPA to power
+void BSPFvdPowerUpFPASim(struct device *dev)
+{
+}
+
+void BSPFvdPowerDownFPASim(struct device *dev)
+{
+}
@@ -0,0 +1,299 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ *    FLIR Video Device driver.
+ *    Read only status page
+ *
+ *    One page, mapped at FVDK_MMAP_STATUS_OFFSET, that user space can
+ *    poll without system calls. Writers hold statusLock and bump the
+ *    sequence count before and after each update, readers retry while
+ *    it is odd or has changed.
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "flir_kernel_os.h"
+#include "fpga.h"
+#include "fvdk_internal.h"
+#include "fvdk_ioctl.h"
+#include <linux/platform_device.h>
+#include <linux/version.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/io.h>
+
+int initFvdkStatus(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	BUILD_BUG_ON(sizeof(struct fvdk_status) > PAGE_SIZE);
+
+	spin_lock_init(&data->statusLock);
+	data->status = (struct fvdk_status *)get_zeroed_page(GFP_KERNEL);
+	if (!data->status)
+		return -ENOMEM;
+
+	data->status->fpga_loaded = data->pDev.fpgaLoaded;
+	return 0;
+}
+
+void freeFvdkStatus(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	free_page((unsigned long)data->status);
+	data->status = NULL;
+}
+
+/**
+ * Map the status page read only
+ *
+ * @return 0 on success, <0 on error
+ */
+int mapFvdkStatus(struct device *dev, struct vm_area_struct *vma)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	if (vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+#if KERNEL_VERSION(6, 3, 0) <= LINUX_VERSION_CODE
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return remap_pfn_range(vma, vma->vm_start,
+			       virt_to_phys(data->status) >> PAGE_SHIFT,
+			       PAGE_SIZE, vma->vm_page_prot);
+}
+
+static void statusBegin(struct fvdkdata *data, unsigned long *flags)
+{
+	spin_lock_irqsave(&data->statusLock, *flags);
+	WRITE_ONCE(data->status->seq, data->status->seq + 1);
+	smp_wmb();
+}
+
+static void statusEnd(struct fvdkdata *data, unsigned long *flags)
+{
+	data->status->update_ns = ktime_get_ns();
+	smp_wmb();
+	WRITE_ONCE(data->status->seq, data->status->seq + 1);
+	spin_unlock_irqrestore(&data->statusLock, *flags);
+}
+
+// Call with statusLock held, returns TRUE if a pin changed
+static BOOL statusPins(struct fvdkdata *data, BOOL ready, BOOL done)
+{
+	BOOL changed = data->status->ready_pin != ready ||
+		data->status->done_pin != done;
+
+	data->status->ready_pin = ready;
+	data->status->done_pin = done;
+	return changed;
+}
+
+/*
+ * spi_flash boards configure a powered FPGA from flash themselves, so
+ * whether it is loaded follows the pins. A configuration counts as a
+ * load when it is first seen. Call with statusLock held, returns TRUE
+ * for a new load.
+ */
+static BOOL statusFlashLoad(struct fvdkdata *data, BOOL ready, BOOL done)
+{
+	BOOL loaded = !ready && done;
+	BOOL load;
+
+	if (!data->pDev.spi_flash || !data->status->fpga_power)
+		return FALSE;
+
+	load = loaded && !data->status->fpga_loaded;
+	data->pDev.fpgaLoaded = loaded;
+	data->status->fpga_loaded = loaded;
+	if (load)
+		data->status->load_generation++;
+	return load;
+}
+
+/**
+ * Sample the READY and CONF_DONE pins into the status page.
+ * Only valid once the board GPIOs have been set up.
+ */
+void updateFvdkPins(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	BOOL ready = data->ops.pGetPinReady(dev);
+	BOOL done = data->ops.pGetPinDone(dev);
+	unsigned long flags;
+	u32 events = 0;
+
+	statusBegin(data, &flags);
+	if (statusPins(data, ready, done))
+		events |= FVDK_EV_PINS;
+	if (statusFlashLoad(data, ready, done))
+		events |= FVDK_EV_LOAD_DONE;
+	statusEnd(data, &flags);
+
+	if (events)
+		fvdkEvent(dev, events);
+}
+
+/**
+ * Record a power transition
+ *
+ * @param fpa TRUE for the FPA supply, FALSE for the FPGA supply
+ */
+void setFvdkPower(struct device *dev, BOOL fpa, BOOL on)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	BOOL ready = data->ops.pGetPinReady(dev);
+	BOOL done = data->ops.pGetPinDone(dev);
+	unsigned long flags;
+	u32 events = FVDK_EV_POWER;
+
+	if (!fpa && !on)
+		data->pDev.fpgaLoaded = FALSE;
+
+	statusBegin(data, &flags);
+	if (fpa) {
+		data->status->fpa_power = on;
+	} else {
+		data->status->fpga_power = on;
+		// An unpowered FPGA loses its configuration
+		if (!on)
+			data->status->fpga_loaded = FALSE;
+	}
+	if (statusPins(data, ready, done))
+		events |= FVDK_EV_PINS;
+	if (statusFlashLoad(data, ready, done))
+		events |= FVDK_EV_LOAD_DONE;
+	statusEnd(data, &flags);
+
+	fvdkEvent(dev, events);
+}
+
+void fvdkLoadStart(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	unsigned long flags;
+
+	statusBegin(data, &flags);
+	data->status->load_start_ns = ktime_get_ns();
+	data->status->loading = TRUE;
+	data->status->load_stage = FVDK_STAGE_READ;
+	data->status->load_sent = 0;
+	data->status->load_size = 0;
+	statusEnd(data, &flags);
+}
+
+/**
+ * Record the end of an FPGA load
+ *
+ * @param res ERROR_SUCCESS or error code of the load
+ */
+void fvdkLoadDone(struct device *dev, DWORD res)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	BOOL ready = data->ops.pGetPinReady(dev);
+	BOOL done = data->ops.pGetPinDone(dev);
+	unsigned long flags;
+	u32 events;
+
+	data->pDev.fpgaLoaded = (res == ERROR_SUCCESS);
+
+	statusBegin(data, &flags);
+	data->status->load_end_ns = ktime_get_ns();
+	data->status->loading = FALSE;
+	data->status->load_stage = FVDK_STAGE_IDLE;
+	data->status->load_result = res;
+	data->status->fpga_loaded = (res == ERROR_SUCCESS);
+	if (res == ERROR_SUCCESS)
+		data->status->load_generation++;
+	events = res == ERROR_SUCCESS ? FVDK_EV_LOAD_DONE : FVDK_EV_LOAD_FAILED;
+	if (statusPins(data, ready, done))
+		events |= FVDK_EV_PINS;
+	statusEnd(data, &flags);
+
+	fvdkEvent(dev, events);
+}
+
+void fvdkLoadStage(struct device *dev, u32 stage)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	unsigned long flags;
+
+	statusBegin(data, &flags);
+	data->status->load_stage = stage;
+	statusEnd(data, &flags);
+}
+
+/**
+ * Record bitstream bytes sent
+ *
+ * @param sent bytes sent so far
+ * @param size bytes in the whole bitstream
+ */
+void fvdkLoadProgress(struct device *dev, u64 sent, u64 size)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	unsigned long flags;
+
+	statusBegin(data, &flags);
+	data->status->load_stage = FVDK_STAGE_SEND;
+	data->status->load_sent = sent;
+	data->status->load_size = size;
+	statusEnd(data, &flags);
+}
+
+void fvdkPowerQueued(struct device *dev, u32 seq)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	unsigned long flags;
+
+	statusBegin(data, &flags);
+	data->status->power_seq = seq;
+	statusEnd(data, &flags);
+}
+
+/**
+ * Record completion of an asynchronous power up
+ *
+ * @param seq last sequence number covered by this power up
+ * @param res ERROR_SUCCESS or error code
+ */
+void fvdkPowerDone(struct device *dev, u32 seq, DWORD res)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	unsigned long flags;
+
+	statusBegin(data, &flags);
+	data->status->power_done = seq;
+	data->status->power_result = res;
+	statusEnd(data, &flags);
+
+	fvdkEvent(dev, FVDK_EV_POWER_DONE);
+}
+
+/**
+ * Get the last completed asynchronous power up
+ *
+ * @param res returns its result
+ *
+ * @return sequence number
+ */
+u32 fvdkPowerCompleted(struct device *dev, u32 *res)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	unsigned long flags;
+	u32 seq;
+
+	spin_lock_irqsave(&data->statusLock, flags);
+	seq = data->status->power_done;
+	*res = data->status->power_result;
+	spin_unlock_irqrestore(&data->statusLock, flags);
+
+	return seq;
+}
@@ -22,18 +22,28 @@
 #include "flir_kernel_os.h"
 #include "fpga.h"
 #include "fvdk_internal.h"
+#include "fvdk_ioctl.h"
 #include "linux/spi/spi.h"
 #include "linux/firmware.h"
 #include <linux/platform_device.h>
 #include <linux/i2c.h>
 #include <linux/errno.h>
 #include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/of.h>
+#include <linux/mtd/mtd.h>
+#include "roco_header.h"
 
 // Definitions
 #define ERROR_NO_INIT_OK        10001
 #define ERROR_NO_CONFIG_DONE    10002
 #define ERROR_NO_SETUP          10003
 #define ERROR_NO_SPI            10004
+#define ERROR_NO_MEMORY         10005
 
 // Local variables
 
@@ -97,30 +107,53 @@ BOOL GetMainboardVersion(struct device *dev, int *article, int *revision)
 #define FW_DIR "FLIR/"
 
 // Code
-PUCHAR getFPGAData(struct device *dev, ULONG *size, char *pHeader)
+
+// Check the fields of a generic header that size the headers
+static BOOL checkGenericHeader(const GENERIC_FPGA_T *pGen)
 {
-	struct fvdkdata *data = dev_get_drvdata(dev);
-	PFVD_DEV_INFO pDev = &data->pDev;
+	return pGen->headerrev <= GENERIC_REV &&
+	       pGen->spec_size <= FPGA_SPEC_MAX_SIZE;
+}
 
+/**
+ * Validate the FPGA headers in front of a bitstream
+ *
+ * @param buf file data, generic header followed by specific header and bitstream
+ * @param len length of buf
+ * @param size returns bitstream size
+ * @param ppGen returns the headers, at the start of buf
+ *
+ * @return pointer to the bitstream in buf, NULL on error
+ */
+static PUCHAR parseFPGAData(struct device *dev, const u8 *buf, size_t len,
+			    ULONG *size, GENERIC_FPGA_T **ppGen)
+{
 	GENERIC_FPGA_T *pGen;
-	BXAB_FPGA_T *pSpec;
-	int err;
-	int article = 0, revision = 0;
-	char *filename;
 
-	GetMainboardVersion(dev, &article, &revision);
-	switch (article) {
-	case 198606:
-		if (revision >= 4)
-			filename = FW_DIR "fpga_neco_c.bin";
-		else
-			filename = FW_DIR "fpga_neco_b.bin";
-		break;
+	/* Read generic header */
+	if (len < sizeof(GENERIC_FPGA_T))
+		return NULL;
 
-	default:
-		filename = FW_DIR "fpga.bin";
-		break;
-	}
+	pGen = (GENERIC_FPGA_T *) buf;
+	if (!checkGenericHeader(pGen))
+		return NULL;
+
+	/* Read specific part */
+	if (len < FPGA_HDR_SIZE(pGen))
+		return NULL;
+
+	/* Set FW size */
+	*size = len - FPGA_HDR_SIZE(pGen);
+
+	*ppGen = pGen;
+	return ((PUCHAR) &buf[FPGA_HDR_SIZE(pGen)]);
+}
+
+static PUCHAR requestFPGAData(struct device *dev, const char *filename,
+			      ULONG *size, GENERIC_FPGA_T **ppGen)
+{
+	PUCHAR fpgaBin;
+	int err;
 
 	/* Request firmware from user space */
 	err = request_firmware(&pFW, filename, dev);
@@ -131,29 +164,50 @@ PUCHAR getFPGAData(struct device *dev, ULONG *size, char *pHeader)
 
 	dev_err(dev, "Got %d bytes of firmware from %s\n", pFW->size, filename);
 
-	/* Read generic header */
-	if (pFW->size < sizeof(GENERIC_FPGA_T))
-		return NULL;
+	fpgaBin = parseFPGAData(dev, pFW->data, pFW->size, size, ppGen);
+	if (fpgaBin == NULL) {
+		dev_err(dev, "Invalid FPGA header in %s\n", filename);
+		freeFpgaData();
+	}
 
-	pGen = (GENERIC_FPGA_T *) pFW->data;
-	if (pGen->headerrev > GENERIC_REV)
-		return NULL;
+	return fpgaBin;
+}
 
-	if (pGen->spec_size > 1024)
-		return NULL;
+static const char *getFPGAFileName(struct device *dev)
+{
+	int article = 0, revision = 0;
 
+	GetMainboardVersion(dev, &article, &revision);
+	switch (article) {
+	case 198606:
+		if (revision >= 4)
+			return FW_DIR "fpga_neco_c.bin";
+		else
+			return FW_DIR "fpga_neco_b.bin";
 
-	/* Read specific part */
-	if (pFW->size < (sizeof(GENERIC_FPGA_T) + pGen->spec_size))
-		return NULL;
+	default:
+		return FW_DIR "fpga.bin";
+	}
+}
 
-	pSpec = (BXAB_FPGA_T *) &pFW->data[sizeof(GENERIC_FPGA_T)];
+/**
+ * Request the main FPGA file and store its header
+ *
+ * @param ppGen returns the headers, valid until freeFpgaData()
+ *
+ * @return pointer to the bitstream, NULL on error
+ */
+PUCHAR getFPGAData(struct device *dev, ULONG *size, GENERIC_FPGA_T **ppGen)
+{
+	PUCHAR fpgaBin;
 
-	/* Set FW size */
-	*size = pFW->size - sizeof(GENERIC_FPGA_T) - pGen->spec_size;
+	fpgaBin = requestFPGAData(dev, getFPGAFileName(dev), size, ppGen);
+	if (fpgaBin && setFPGAHeader(dev, *ppGen, FPGA_HDR_SIZE(*ppGen))) {
+		freeFpgaData();
+		fpgaBin = NULL;
+	}
 
-	memcpy(pHeader, pFW->data, sizeof(GENERIC_FPGA_T) + pGen->spec_size);
-	return ((PUCHAR) &pFW->data[sizeof(GENERIC_FPGA_T) + pGen->spec_size]);
+	return fpgaBin;
 }
 
 void freeFpgaData(void)
@@ -180,6 +234,28 @@ DWORD CheckFPGA(struct device *dev)
 	return res;
 }
 
+/**
+ * Check result of a partial reconfiguration.
+ * CONF_DONE stays high during partial configuration, a CRC or
+ * sequence error is signalled by nSTATUS going low instead.
+ */
+static DWORD CheckFPGAPartial(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+
+	DWORD res = ERROR_SUCCESS;
+
+	if (data->ops.pGetPinStatus(dev) == 0)
+		res = ERROR_NO_INIT_OK;
+	else if (data->ops.pGetPinDone(dev) == 0)
+		res = ERROR_NO_CONFIG_DONE;
+
+	if (res != ERROR_SUCCESS)
+		dev_err(dev, "FPGA partial load failed (%ld)\n", res);
+
+	return res;
+}
+
 struct spi_board_info chip = {
 	.modalias = "fvdspi",
 	.max_speed_hz = 50000000,
@@ -194,41 +270,17 @@ struct spi_board_info chip = {
 #define gettime(tp) (do_gettimeofday(tp))
 #endif
 
-DWORD LoadFPGA(struct device *dev, char *szFileName)
+/**
+ * Swap bit and byte order of the bitstream in place
+ *
+ * @param pGen generic header of the bitstream
+ * @param fpgaBin bitstream data
+ * @param size bitstream size in bytes
+ */
+static void rotateFPGAData(GENERIC_FPGA_T *pGen, unsigned char *fpgaBin,
+			   unsigned long size)
 {
-	struct fvdkdata *data = dev_get_drvdata(dev);
-	PFVD_DEV_INFO pDev = &data->pDev;
-	DWORD res = ERROR_SUCCESS;
-	unsigned long size;
-	unsigned char *fpgaBin;
-	int ret;
-	struct spi_master *pspim;
-	struct spi_device *pspid;
-#if KERNEL_VERSION(5, 4, 0) <= LINUX_VERSION_CODE
-	ktime_t t[10];
-#else
-	struct timeval t[10];
-#endif
-
-	gettime(&t[0]);
-
-	// read file
-	fpgaBin = getFPGAData(dev, &size, pDev->fpga);
-	if (fpgaBin == NULL) {
-		dev_err(dev, "Error reading %s\n", szFileName);
-		return ERROR_IO_DEVICE;
-	}
-
-	if (data->ops.pGetPinDone(dev)) {
-		dev_err(dev, "Fpga has already been programmed in uboot");
-		goto done;
-		//platforms with pcie loads fpga in u-boot
-	}
-
-	gettime(&t[1]);
-
-	// swap bit and byte order
-	if (((GENERIC_FPGA_T *) (pDev->fpga))->LSBfirst) {
+	if (pGen->LSBfirst) {
 		ULONG *ptr = (ULONG *) fpgaBin;
 		int len = (size + 3) / 4;
 		static const char reverseNibble[16] = { 0x00, 0x08, 0x04, 0x0C,	// 0, 1, 2, 3
@@ -261,49 +313,167 @@ DWORD LoadFPGA(struct device *dev, char *szFileName)
 			ptr++;
 		}
 	}
+}
 
-	dev_err(dev, "Activating programming mode\n");
-
-	gettime(&t[2]);
-
-	// Put FPGA in programming mode
-	if (data->ops.pPutInProgrammingMode(dev) == 0) {
-		msleep(5);
-		if (data->ops.pPutInProgrammingMode(dev) == 0) {
-			dev_err(dev, "Failed to set FPGA in programming mode\n");
-			freeFpgaData();
-			return ERROR_NO_SETUP;
-		}
-	}
+/* Transfer length for size bytes of bitstream, rounded to whole words */
+static unsigned long spiLenFPGA(PFVD_DEV_INFO pDev, unsigned long size)
+{
+	return ((size / pDev->iSpiCountDivisor) +
+		pDev->iSpiCountDivisor - 1) & ~3;
+}
 
-	gettime(&t[3]);
+static struct spi_device *openFPGASpi(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	PFVD_DEV_INFO pDev = &data->pDev;
+	struct spi_master *pspim;
+	struct spi_device *pspid;
 
 	dev_err(dev, "Sending FPGA code over SPI%d\n", pDev->iSpiBus);
 
-	// Send FPGA code through SPI
 	pspim = spi_busnum_to_master(pDev->iSpiBus);
 	if (pspim == 0) {
 		dev_err(dev, "Failed to get SPI master\n");
-		return ERROR_NO_SPI;
+		return NULL;
 	}
 	pspid = spi_new_device(pspim, &chip);
 	if (pspid == 0) {
 		dev_err(dev, "Failed to set SPI device\n");
-		return ERROR_NO_SPI;
+		put_device(&pspim->dev);
+		return NULL;
 	}
 	pspid->bits_per_word = 32;
-	ret = spi_setup(pspid);
-	ret = spi_write(pspid, fpgaBin,
-			((size / pDev->iSpiCountDivisor) +
-			 pDev->iSpiCountDivisor - 1) & ~3);
+	if (spi_setup(pspid)) {
+		dev_err(dev, "Failed to setup SPI device\n");
+		device_unregister(&pspid->dev);
+		put_device(&pspim->dev);
+		return NULL;
+	}
+
+	return pspid;
+}
+
+static void closeFPGASpi(struct spi_device *pspid)
+{
+	struct spi_master *pspim = pspid->master;
 
 	device_unregister(&pspid->dev);
 	put_device(&pspim->dev);
+}
+
+/* Bytes per transfer, progress is reported in between */
+#define FPGA_SEND_CHUNK	(256 * 1024)
+
+/**
+ * Send bitstream to the FPGA, through the SPI master or the
+ * pWriteFpgaData backend when the board provides one. The SPI transfer
+ * length is computed for the whole bitstream and then split in chunks.
+ *
+ * @return ERROR_SUCCESS or error code
+ */
+static DWORD sendFPGAData(struct device *dev, unsigned char *fpgaBin,
+			  unsigned long size)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	PFVD_DEV_INFO pDev = &data->pDev;
+	struct spi_device *pspid = NULL;
+	DWORD res = ERROR_SUCCESS;
+	unsigned long sent;
+	int ret;
+
+	if (!data->ops.pWriteFpgaData) {
+		pspid = openFPGASpi(dev);
+		if (pspid == NULL)
+			return ERROR_NO_SPI;
+		size = spiLenFPGA(pDev, size);
+	}
+
+	fvdkLoadProgress(dev, 0, size);
+	for (sent = 0; sent < size && res == ERROR_SUCCESS; ) {
+		unsigned long len = min_t(unsigned long, size - sent,
+					  FPGA_SEND_CHUNK);
+
+		if (pspid == NULL) {
+			res = data->ops.pWriteFpgaData(dev, &fpgaBin[sent], len);
+		} else {
+			ret = spi_write(pspid, &fpgaBin[sent], len);
+			if (ret) {
+				dev_err(dev, "SPI transfer failed (%d)\n", ret);
+				res = ERROR_IO_DEVICE;
+			}
+		}
+		sent += len;
+		fvdkLoadProgress(dev, sent, size);
+	}
+
+	if (pspid)
+		closeFPGASpi(pspid);
+
+	return res;
+}
+
+#if KERNEL_VERSION(5, 4, 0) <= LINUX_VERSION_CODE
+typedef ktime_t fpga_time_t;
+#else
+typedef struct timeval fpga_time_t;
+#endif
+
+/**
+ * Configure the FPGA with a bitstream that has been read into memory.
+ * The bitstream is rotated in place.
+ *
+ * @param pGen generic header of the bitstream
+ * @param start time the load started, for the timing report
+ * @param force reconfigure even if CONF_DONE is already set
+ *
+ * @return ERROR_SUCCESS or error code
+ */
+static DWORD programFPGA(struct device *dev, GENERIC_FPGA_T *pGen,
+			 unsigned char *fpgaBin, unsigned long size,
+			 fpga_time_t *start, BOOL force)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	DWORD res = ERROR_SUCCESS;
+	fpga_time_t t[6];
+
+	t[0] = *start;
+
+	if (!force && data->ops.pGetPinDone(dev)) {
+		dev_err(dev, "Fpga has already been programmed in uboot");
+		return ERROR_SUCCESS;
+		//platforms with pcie loads fpga in u-boot
+	}
+
+	gettime(&t[1]);
+
+	// swap bit and byte order
+	rotateFPGAData(pGen, fpgaBin, size);
+
+	dev_err(dev, "Activating programming mode\n");
+
+	gettime(&t[2]);
+	fvdkLoadStage(dev, FVDK_STAGE_PROGRAM);
+
+	// Put FPGA in programming mode
+	if (data->ops.pPutInProgrammingMode(dev) == 0) {
+		msleep(5);
+		if (data->ops.pPutInProgrammingMode(dev) == 0) {
+			dev_err(dev, "Failed to set FPGA in programming mode\n");
+			return ERROR_NO_SETUP;
+		}
+	}
+
+	gettime(&t[3]);
+
+	// Send FPGA code through SPI
+	res = sendFPGAData(dev, fpgaBin, size);
 
 	gettime(&t[4]);
+	fvdkLoadStage(dev, FVDK_STAGE_CHECK);
 
 	//programming OK?
-	res = CheckFPGA(dev);
+	if (res == ERROR_SUCCESS)
+		res = CheckFPGA(dev);
 
 	gettime(&t[5]);
 
@@ -312,7 +482,557 @@ DWORD LoadFPGA(struct device *dev, char *szFileName)
 		tms(t[5]) - tms(t[0]), tms(t[1]) - tms(t[0]),
 		tms(t[2]) - tms(t[1]), tms(t[3]) - tms(t[2]),
 		tms(t[4]) - tms(t[3]), tms(t[5]) - tms(t[4]));
+
+	return res;
+}
+
+/*
+ * Raw MTD partition holding an fpga.bin image (headers and bitstream),
+ * used instead of the firmware loader on boards without SPI flash.
+ * Overridden by the "fpga-mtd" device tree property.
+ */
+static char *fpga_mtd;
+module_param(fpga_mtd, charp, 0444);
+MODULE_PARM_DESC(fpga_mtd, "Raw MTD partition name to load the FPGA from");
+
+#define FPGA_MTD_CHUNK	(32 * 1024)
+
+struct fpga_chunk {
+	struct spi_message msg;
+	struct spi_transfer xfer;
+	struct completion done;
+	unsigned char *buf;
+	BOOL busy;
+};
+
+static void fpgaChunkComplete(void *context)
+{
+	struct fpga_chunk *chunk = context;
+
+	complete(&chunk->done);
+}
+
+static int waitFPGAChunk(struct fpga_chunk *chunk)
+{
+	if (!chunk->busy)
+		return 0;
+	wait_for_completion(&chunk->done);
+	chunk->busy = FALSE;
+	return chunk->msg.status;
+}
+
+static const char *getFPGAMtdName(struct device *dev)
+{
+	const char *name;
+
+	if (dev->of_node &&
+	    !of_property_read_string(dev->of_node, "fpga-mtd", &name))
+		return name;
+
+	return fpga_mtd;
+}
+
+/**
+ * Read generic and specific header from the start of an MTD image
+ *
+ * @return kmalloc'ed header of FPGA_HDR_SIZE() bytes, ERR_PTR on error
+ */
+static GENERIC_FPGA_T *readFPGAHeaderMtd(struct mtd_info *mtd)
+{
+	GENERIC_FPGA_T *pGen;
+	char *header;
+	int ret;
+
+	pGen = kmalloc(sizeof(GENERIC_FPGA_T), GFP_KERNEL);
+	if (!pGen)
+		return ERR_PTR(-ENOMEM);
+
+	ret = read_mtd(mtd, 0, sizeof(GENERIC_FPGA_T), (unsigned char *)pGen);
+	if (ret)
+		goto err;
+
+	if (!checkGenericHeader(pGen)) {
+		ret = -EINVAL;
+		goto err;
+	}
+
+	header = krealloc(pGen, FPGA_HDR_SIZE(pGen), GFP_KERNEL);
+	if (!header) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	pGen = (GENERIC_FPGA_T *) header;
+
+	ret = read_mtd(mtd, sizeof(GENERIC_FPGA_T), pGen->spec_size,
+		       &header[sizeof(GENERIC_FPGA_T)]);
+	if (ret)
+		goto err;
+
+	return pGen;
+err:
+	kfree(pGen);
+	return ERR_PTR(ret);
+}
+
+/**
+ * Stream the bitstream from MTD to the FPGA. The next chunk is read
+ * from flash and rotated while the previous one is on the SPI bus.
+ *
+ * @return ERROR_SUCCESS or error code
+ */
+static DWORD streamFPGAFromMtd(struct device *dev, struct mtd_info *mtd,
+			       GENERIC_FPGA_T *pGen, loff_t offset,
+			       unsigned long size)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	PFVD_DEV_INFO pDev = &data->pDev;
+	struct fpga_chunk chunks[2] = {};
+	struct spi_device *pspid = NULL;
+	DWORD res = ERROR_SUCCESS;
+	unsigned long total;
+	int i, ret;
+
+	for (i = 0; i < 2; i++) {
+		chunks[i].buf = kmalloc(FPGA_MTD_CHUNK, GFP_KERNEL);
+		if (!chunks[i].buf) {
+			res = ERROR_NO_MEMORY;
+			goto out;
+		}
+	}
+
+	if (!data->ops.pWriteFpgaData) {
+		pspid = openFPGASpi(dev);
+		if (pspid == NULL) {
+			res = ERROR_NO_SPI;
+			goto out;
+		}
+		// Whole transfer length, streamed in chunks
+		size = spiLenFPGA(pDev, size);
+	}
+	total = size;
+
+	for (i = 0; size && res == ERROR_SUCCESS; i ^= 1) {
+		struct fpga_chunk *chunk = &chunks[i];
+		unsigned long len = min_t(unsigned long, size, FPGA_MTD_CHUNK);
+
+		// Buffer is free once its previous transfer has completed
+		ret = waitFPGAChunk(chunk);
+		if (ret) {
+			dev_err(dev, "SPI transfer failed (%d)\n", ret);
+			res = ERROR_IO_DEVICE;
+			break;
+		}
+
+		ret = read_mtd(mtd, offset, len, chunk->buf);
+		if (ret) {
+			res = ERROR_IO_DEVICE;
+			break;
+		}
+		rotateFPGAData(pGen, chunk->buf, len);
+
+		if (pspid == NULL) {
+			res = data->ops.pWriteFpgaData(dev, chunk->buf, len);
+		} else {
+			spi_message_init(&chunk->msg);
+			memset(&chunk->xfer, 0, sizeof(chunk->xfer));
+			chunk->xfer.tx_buf = chunk->buf;
+			chunk->xfer.len = len;
+			spi_message_add_tail(&chunk->xfer, &chunk->msg);
+			init_completion(&chunk->done);
+			chunk->msg.complete = fpgaChunkComplete;
+			chunk->msg.context = chunk;
+			ret = spi_async(pspid, &chunk->msg);
+			if (ret) {
+				dev_err(dev, "SPI transfer failed (%d)\n", ret);
+				res = ERROR_IO_DEVICE;
+				break;
+			}
+			chunk->busy = TRUE;
+		}
+
+		offset += len;
+		size -= len;
+		fvdkLoadProgress(dev, total - size, total);
+	}
+
+	for (i = 0; i < 2; i++) {
+		ret = waitFPGAChunk(&chunks[i]);
+		if (ret && res == ERROR_SUCCESS) {
+			dev_err(dev, "SPI transfer failed (%d)\n", ret);
+			res = ERROR_IO_DEVICE;
+		}
+	}
+
+	if (pspid)
+		closeFPGASpi(pspid);
+out:
+	kfree(chunks[0].buf);
+	kfree(chunks[1].buf);
+	return res;
+}
+
+/**
+ * Configure the FPGA from a raw MTD partition, without the firmware
+ * loader and thus without a mounted file system.
+ *
+ * @return ERROR_SUCCESS or error code
+ */
+static DWORD loadFPGAFromMtd(struct device *dev, const char *name)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	GENERIC_FPGA_T *pGen;
+	struct mtd_info *mtd;
+	DWORD res = ERROR_SUCCESS;
+	unsigned long size;
+	loff_t offset;
+	fpga_time_t t[5];
+
+	gettime(&t[0]);
+
+	mtd = get_mtd_device_nm(name);
+	if (IS_ERR(mtd)) {
+		dev_err(dev, "Failed to get mtd device %s\n", name);
+		return ERROR_IO_DEVICE;
+	}
+
+	// Headers first, they give the offset and size of the bitstream
+	pGen = readFPGAHeaderMtd(mtd);
+	if (IS_ERR(pGen)) {
+		dev_err(dev, "Invalid FPGA header in mtd %s\n", name);
+		pGen = NULL;
+		res = ERROR_IO_DEVICE;
+		goto out;
+	}
+	if (setFPGAHeader(dev, pGen, FPGA_HDR_SIZE(pGen))) {
+		res = ERROR_IO_DEVICE;
+		goto out;
+	}
+
+	offset = FPGA_HDR_SIZE(pGen);
+	size = FPGA_GEN_SIZE(pGen);
+	if (size == 0)
+		size = mtd->size - offset;
+	if (offset + size > mtd->size) {
+		dev_err(dev, "FPGA bitstream exceeds mtd %s\n", name);
+		res = ERROR_IO_DEVICE;
+		goto out;
+	}
+
+	if (data->ops.pGetPinDone(dev)) {
+		dev_err(dev, "Fpga has already been programmed in uboot");
+		goto out;
+	}
+
+	gettime(&t[1]);
+	fvdkLoadStage(dev, FVDK_STAGE_PROGRAM);
+
+	if (data->ops.pPutInProgrammingMode(dev) == 0) {
+		msleep(5);
+		if (data->ops.pPutInProgrammingMode(dev) == 0) {
+			dev_err(dev, "Failed to set FPGA in programming mode\n");
+			res = ERROR_NO_SETUP;
+			goto out;
+		}
+	}
+
+	gettime(&t[2]);
+
+	res = streamFPGAFromMtd(dev, mtd, pGen, offset, size);
+
+	gettime(&t[3]);
+	fvdkLoadStage(dev, FVDK_STAGE_CHECK);
+
+	if (res == ERROR_SUCCESS)
+		res = CheckFPGA(dev);
+
+	gettime(&t[4]);
+
+	dev_err(dev, "FPGA loaded from %s in %ld ms (header %ld prep %ld read+SPI %ld check %ld)\n",
+		name, tms(t[4]) - tms(t[0]), tms(t[1]) - tms(t[0]),
+		tms(t[2]) - tms(t[1]), tms(t[3]) - tms(t[2]),
+		tms(t[4]) - tms(t[3]));
+out:
+	kfree(pGen);
+	put_mtd_device(mtd);
+	return res;
+}
+
+DWORD LoadFPGA(struct device *dev, char *szFileName)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	PFVD_DEV_INFO pDev = &data->pDev;
+	DWORD res;
+	unsigned long size;
+	unsigned char *fpgaBin;
+	GENERIC_FPGA_T *pGen;
+	fpga_time_t start;
+	const char *name;
+
+	mutex_lock(&data->muLoad);
+	fvdkLoadStart(dev);
+
+	name = getFPGAMtdName(dev);
+	if (!pDev->spi_flash && name) {
+		res = loadFPGAFromMtd(dev, name);
+		goto out;
+	}
+
+	gettime(&start);
+
+	// read file
+	fpgaBin = getFPGAData(dev, &size, &pGen);
+	if (fpgaBin == NULL) {
+		dev_err(dev, "Error reading %s\n", szFileName);
+		res = ERROR_IO_DEVICE;
+		goto out;
+	}
+
+	res = programFPGA(dev, pGen, fpgaBin, size, &start, FALSE);
+
+	freeFpgaData();
+out:
+	fvdkLoadDone(dev, res);
+	mutex_unlock(&data->muLoad);
+	return res;
+}
+
+/**
+ * Configure the FPGA from a bitstream file image supplied by user space,
+ * either as a memory buffer or as a readable file descriptor (memfd).
+ * The data is copied once, straight into the buffer handed to the SPI
+ * master, and rotated in place there.
+ *
+ * @return ERROR_SUCCESS or error code
+ */
+DWORD LoadFPGAUser(struct device *dev, const struct fvdk_load_user *req)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	DWORD res;
+	unsigned long size;
+	unsigned char *buf;
+	unsigned char *fpgaBin;
+	GENERIC_FPGA_T *pGen;
+	fpga_time_t start;
+
+	if (req->size == 0 || req->size > FPGA_USER_MAX_SIZE)
+		return ERROR_INVALID_PARAMETER;
+
+	gettime(&start);
+
+	buf = vmalloc(req->size);
+	if (!buf)
+		return ERROR_NO_MEMORY;
+
+	if (req->fd >= 0) {
+		struct file *file = fget(req->fd);
+		loff_t pos = 0;
+		ssize_t len;
+
+		if (!file) {
+			res = ERROR_INVALID_PARAMETER;
+			goto out_free;
+		}
+#if KERNEL_VERSION(4, 14, 0) <= LINUX_VERSION_CODE
+		len = kernel_read(file, buf, req->size, &pos);
+#else
+		len = kernel_read(file, pos, buf, req->size);
+#endif
+		fput(file);
+		if (len != req->size) {
+			dev_err(dev, "Short read of FPGA data from fd %d (%zd)\n",
+				req->fd, len);
+			res = ERROR_IO_DEVICE;
+			goto out_free;
+		}
+	} else if (copy_from_user(buf, (void __user *)(uintptr_t)req->addr,
+				  req->size)) {
+		res = ERROR_IO_DEVICE;
+		goto out_free;
+	}
+
+	mutex_lock(&data->muLoad);
+
+	fpgaBin = parseFPGAData(dev, buf, req->size, &size, &pGen);
+	if (fpgaBin == NULL || setFPGAHeader(dev, pGen, FPGA_HDR_SIZE(pGen))) {
+		dev_err(dev, "Invalid FPGA header in user buffer\n");
+		res = ERROR_INVALID_PARAMETER;
+	} else {
+		fvdkLoadStart(dev);
+		res = programFPGA(dev, pGen, fpgaBin, size, &start, TRUE);
+		fvdkLoadDone(dev, res);
+	}
+
+	mutex_unlock(&data->muLoad);
+out_free:
+	vfree(buf);
+	return res;
+}
+
+/**
+ * Load a partial reconfiguration bitstream on top of a configured FPGA.
+ * The FPGA is not put in programming mode, the region data is streamed
+ * over the same SPI channel as a full configuration.
+ *
+ * @param szFileName file name relative to the FLIR firmware directory
+ *
+ * @return ERROR_SUCCESS or error code
+ */
+DWORD LoadFPGAPartial(struct device *dev, const char *szFileName)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	DWORD res = ERROR_SUCCESS;
+	unsigned long size;
+	unsigned char *fpgaBin;
+	GENERIC_FPGA_T *pGen;
+	char *filename;
+	fpga_time_t t[5];
+
+	if (!*szFileName || strstr(szFileName, ".."))
+		return ERROR_INVALID_PARAMETER;
+
+	filename = kasprintf(GFP_KERNEL, FW_DIR "%s", szFileName);
+	if (!filename)
+		return ERROR_NO_MEMORY;
+
+	mutex_lock(&data->muLoad);
+	gettime(&t[0]);
+
+	// Partial regions are only valid on top of a configured base design
+	if (data->ops.pGetPinDone(dev) == 0) {
+		dev_err(dev, "FPGA not configured, can not load %s\n", filename);
+		res = ERROR_NO_CONFIG_DONE;
+		goto out;
+	}
+
+	// The partial header is not stored, it describes the region only
+	fpgaBin = requestFPGAData(dev, filename, &size, &pGen);
+	if (fpgaBin == NULL) {
+		res = ERROR_IO_DEVICE;
+		goto out;
+	}
+
+	if (!(FPGA_GEN_FLAGS(pGen) & FPGA_GEN_PARTIAL)) {
+		dev_err(dev, "%s is not a partial bitstream\n", filename);
+		res = ERROR_INVALID_PARAMETER;
+		goto done;
+	}
+
+	gettime(&t[1]);
+
+	rotateFPGAData(pGen, fpgaBin, size);
+
+	gettime(&t[2]);
+
+	res = sendFPGAData(dev, fpgaBin, size);
+
+	gettime(&t[3]);
+
+	if (res == ERROR_SUCCESS)
+		res = CheckFPGAPartial(dev);
+
+	gettime(&t[4]);
+
+	dev_err(dev, "FPGA partial %s loaded in %ld ms (read %ld rotate %ld SPI %ld check %ld)\n",
+		filename, tms(t[4]) - tms(t[0]), tms(t[1]) - tms(t[0]),
+		tms(t[2]) - tms(t[1]), tms(t[3]) - tms(t[2]),
+		tms(t[4]) - tms(t[3]));
 done:
 	freeFpgaData();
+	fvdkLoadStage(dev, FVDK_STAGE_IDLE);
+out:
+	mutex_unlock(&data->muLoad);
+	kfree(filename);
 	return res;
 }
+
+/**
+ * Read only the headers of the FPGA image, without loading the
+ * bitstream, so the frame buffer geometry can be queried before and
+ * in parallel with FPGA power up and load.
+ *
+ * @return 0 on success, <0 on error
+ */
+int getFPGAHeader(struct device *dev)
+{
+	struct fvdkdata *data = dev_get_drvdata(dev);
+	GENERIC_FPGA_T *pGen = NULL;
+	const char *name;
+	int ret;
+
+	if (data->pDev.fpgaHeaderValid)
+		return 0;
+
+	name = getFPGAMtdName(dev);
+	if (name) {
+		struct mtd_info *mtd = get_mtd_device_nm(name);
+
+		if (IS_ERR(mtd)) {
+			ret = PTR_ERR(mtd);
+		} else {
+			pGen = readFPGAHeaderMtd(mtd);
+			put_mtd_device(mtd);
+			ret = PTR_ERR_OR_ZERO(pGen);
+			if (ret)
+				pGen = NULL;
+		}
+	} else {
+		const struct firmware *fw;
+
+		name = getFPGAFileName(dev);
+#if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
+		// Two small reads instead of pulling in the whole file, with
+		// the checks of parseFPGAData()
+		pGen = kzalloc(sizeof(GENERIC_FPGA_T), GFP_KERNEL);
+		if (!pGen)
+			return -ENOMEM;
+		ret = request_partial_firmware_into_buf(&fw, name, dev, pGen,
+							sizeof(GENERIC_FPGA_T), 0);
+		if (ret == 0) {
+			if (fw->size < sizeof(GENERIC_FPGA_T) ||
+			    !checkGenericHeader(pGen))
+				ret = -EINVAL;
+			release_firmware(fw);
+		}
+		if (ret == 0 && pGen->spec_size) {
+			char *header = krealloc(pGen, FPGA_HDR_SIZE(pGen), GFP_KERNEL);
+
+			if (!header) {
+				ret = -ENOMEM;
+			} else {
+				pGen = (GENERIC_FPGA_T *) header;
+				ret = request_partial_firmware_into_buf(&fw, name, dev,
+									&header[sizeof(GENERIC_FPGA_T)],
+									pGen->spec_size,
+									sizeof(GENERIC_FPGA_T));
+			}
+			if (ret == 0) {
+				if (fw->size < pGen->spec_size)
+					ret = -EINVAL;
+				release_firmware(fw);
+			}
+		}
+#else
+		ret = request_firmware(&fw, name, dev);
+		if (ret == 0) {
+			GENERIC_FPGA_T *pFile;
+			ULONG size;
+
+			if (parseFPGAData(dev, fw->data, fw->size, &size, &pFile) == NULL)
+				ret = -EINVAL;
+			else
+				pGen = kmemdup(pFile, FPGA_HDR_SIZE(pFile), GFP_KERNEL);
+			if (ret == 0 && !pGen)
+				ret = -ENOMEM;
+			release_firmware(fw);
+		}
+#endif
+	}
+
+	if (ret == 0)
+		ret = setFPGAHeader(dev, pGen, FPGA_HDR_SIZE(pGen));
+	if (ret)
+		dev_err(dev, "Failed to read FPGA header from %s (%d)\n", name, ret);
+
+	kfree(pGen);
+	return ret;
+}
@@ -7,6 +7,12 @@
 #include "fpga.h"
 #include "roco_header.h"
 #include <linux/mtd/mtd.h>
+#include <linux/module.h>
+
+/* MTD device holding the FPGA image, may point at mtdram for testing */
+static int mtd_device = MTD_DEVICE;
+module_param(mtd_device, int, 0444);
+MODULE_PARM_DESC(mtd_device, "MTD device number of the FPGA SPI flash");
 
 #if KERNEL_VERSION(3, 3, 0) > LINUX_VERSION_CODE
 int mtd_read(struct mtd_info *mtd, loff_t from, size_t len, size_t *retlen,
@@ -17,20 +23,45 @@ int mtd_read(struct mtd_info *mtd, loff_t from, size_t len, size_t *retlen,
 };
 #endif
 
+/**
+ * Read from mtd device, corrected bitflips are not treated as errors
+ *
+ * @return 0 on success, <0 on error
+ */
+int read_mtd(struct mtd_info *mtd, loff_t from, size_t len, unsigned char *buf)
+{
+	size_t retlen;
+	int ret = mtd_read(mtd, from, len, &retlen, buf);
+
+	if (mtd_is_bitflip(ret))
+		ret = 0;
+	if (ret != 0 || retlen != len) {
+		pr_err("Failed reading mtd %s at 0x%llx %d %zu\n", mtd->name,
+		       (unsigned long long)from, ret, retlen);
+		return ret ? ret : -EIO;
+	}
+
+	return 0;
+}
+
 /**
  * Read header from spi device
  *
- * rxbuf - allocated buffer the size of HEADER_LENGTH
- * @return header data on success, else NULL
+ * rxbuf - allocated buffer of at least len bytes
+ * len - bytes to read from the start of the header, at most HEADER_LENGTH
+ * @return 0 on success, <0 on error
  */
-int read_header(struct mtd_info *mtd, unsigned char *rxbuf)
+int read_header(struct mtd_info *mtd, unsigned char *rxbuf, size_t len)
 {
-	int address = (mtd->size - HEADER_LENGTH);
-	int retlen;
-	int ret = mtd_read(mtd, address, HEADER_LENGTH, &retlen, rxbuf);
+	loff_t address = (mtd->size - HEADER_LENGTH);
+	int ret;
+
+	if (len < 4 || len > HEADER_LENGTH)
+		return -EINVAL;
 
-	if (ret != 0 || retlen != HEADER_LENGTH) {
-		pr_err("Failed reading spi flash %d %d\n", ret, retlen);
+	ret = read_mtd(mtd, address, len, rxbuf);
+	if (ret) {
+		pr_err("Failed reading spi flash %d\n", ret);
 		return -ENODEV;
 	}
 
@@ -134,16 +165,25 @@ int extract_headers(unsigned char *rxbuf, GENERIC_FPGA_T *pGen,
 	return 0;
 }
 
+/**
+ * Get the mtd device of the FPGA SPI flash, put it after use
+ */
+struct mtd_info *get_fpga_mtd(void)
+{
+	return get_mtd_device(NULL, mtd_device);
+}
+
 /**
  * Read data from SPI Device,
  *
  * @param rxbuf
+ * @param len bytes of header to read
  *
  * @return 0 on success, <0 on error
  */
-int read_spi_header(unsigned char *rxbuf)
+int read_spi_header(unsigned char *rxbuf, size_t len)
 {
-	struct mtd_info *mtd = get_mtd_device(NULL, MTD_DEVICE);
+	struct mtd_info *mtd = get_fpga_mtd();
 	int ret;
 
 	if (IS_ERR(mtd)) {
@@ -151,7 +191,7 @@ int read_spi_header(unsigned char *rxbuf)
 		return PTR_ERR(mtd);
 	}
 
-	ret = read_header(mtd, rxbuf);
+	ret = read_header(mtd, rxbuf, len);
 	put_mtd_device(mtd);
 	return ret;
 }
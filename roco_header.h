@@ -5,10 +5,14 @@
 #define HEADER_LENGTH  65536
 #define MTD_DEVICE 0
 
-int read_header(struct mtd_info *mtd, unsigned char *rxbuf);
+struct mtd_info;
+
+int read_mtd(struct mtd_info *mtd, loff_t from, size_t len, unsigned char *buf);
+int read_header(struct mtd_info *mtd, unsigned char *rxbuf, size_t len);
 void prerr_generic_header(GENERIC_FPGA_T *pGen);
 void prerr_specific_header(BXAB_FPGA_T *pSpec);
 int extract_headers(unsigned char *rxbuf, GENERIC_FPGA_T *pGen,
 		    BXAB_FPGA_T *pSpec);
-int read_spi_header(unsigned char *rxbuf);
+int read_spi_header(unsigned char *rxbuf, size_t len);
+struct mtd_info *get_fpga_mtd(void);
 #endif